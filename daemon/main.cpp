@@ -0,0 +1,47 @@
+//
+// Created by dingjing on 10/18/26.
+//
+
+#include <QDebug>
+#include <QString>
+#include <csignal>
+
+#include "scan-server.h"
+#include "scan-service.h"
+
+
+static ScanServer* gServer = nullptr;
+
+static void on_signal(int sig)
+{
+    (void) sig;
+    if (gServer) {
+        gServer->stop();
+    }
+}
+
+int main (int argc, char* argv[])
+{
+    const QString socketPath = (argc > 1) ? QString::fromLocal8Bit(argv[1]) : QString(SCAN_SERVICE_SOCKET);
+
+    signal(SIGPIPE, SIG_IGN);
+
+    ScanServer server(socketPath);
+    if (!server.listen()) {
+        return -1;
+    }
+
+    gServer = &server;
+
+    struct sigaction sa = {};
+    sa.sa_handler = on_signal;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, nullptr);
+    sigaction(SIGTERM, &sa, nullptr);
+
+    server.run();
+
+    gServer = nullptr;
+
+    return 0;
+}
@@ -0,0 +1,543 @@
+//
+// Created by dingjing on 10/18/26.
+//
+
+#include "scan-server.h"
+
+#include <QDebug>
+#include <QDataStream>
+#include <QCryptographicHash>
+#include <fcntl.h>
+#include <cerrno>
+#include <chrono>
+#include <thread>
+#include <cstring>
+#include <unistd.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+
+#include "scan-service.h"
+#include "macros/macros.h"
+
+#define SCAN_SERVER_BLOCK_SIZE      (2 << 20)       // 不超过此大小的文件整体读入后块模式扫描, 更大的按此大小流式扫描
+
+
+static QByteArray reply_error(qint32 status, const QString& error);
+
+
+ScanServer::ScanServer(const QString& socketPath, int maxRuleSets, int socketMode, const ScanServerLimits& limits)
+    : mSocketPath(socketPath), mSocketMode(socketMode), mMaxRuleSets(static_cast<std::size_t>(qMax(1, maxRuleSets))), mLimits(limits), mStop(false)
+{
+    mLimits.maxConnections = qMax<std::size_t>(1, mLimits.maxConnections);
+    mLimits.maxCompiles = qMax<std::size_t>(1, mLimits.maxCompiles);
+}
+
+ScanServer::~ScanServer()
+{
+    if (mListenFd >= 0) {
+        ::close(mListenFd);
+        ::unlink(mSocketPath.toUtf8().constData());
+    }
+}
+
+bool ScanServer::listen()
+{
+    struct sockaddr_un addr = {};
+    const QByteArray path = mSocketPath.toUtf8();
+    if (path.isEmpty() || path.size() >= static_cast<int>(sizeof(addr.sun_path))) {
+        qWarning() << "Invalid socket path: " << mSocketPath;
+        return false;
+    }
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, path.constData(), path.size());
+
+    const int sock = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0) {
+        qWarning() << "socket error: " << strerror(errno);
+        return false;
+    }
+
+    // 能连上说明已有服务在运行, 否则是上次遗留的套接字文件
+    if (0 == ::connect(sock, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr))) {
+        qWarning() << "Scan service is already running on " << mSocketPath;
+        ::close(sock);
+        return false;
+    }
+    ::close(sock);
+    ::unlink(path.constData());
+
+    mListenFd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (mListenFd < 0
+        || 0 != ::bind(mListenFd, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr))
+        || 0 != ::chmod(path.constData(), static_cast<mode_t>(mSocketMode))
+        || 0 != ::listen(mListenFd, SOMAXCONN)) {
+        qWarning() << "listen on " << mSocketPath << " error: " << strerror(errno);
+        if (mListenFd >= 0) {
+            ::close(mListenFd);
+            mListenFd = -1;
+        }
+        return false;
+    }
+
+    qInfo() << "Scan service listening on " << mSocketPath;
+
+    return true;
+}
+
+void ScanServer::run()
+{
+    C_RETURN_IF_FAIL(mListenFd >= 0);
+
+    while (!mStop) {
+        const int sock = ::accept4(mListenFd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (sock < 0) {
+            if (mStop) {
+                break;
+            }
+            if (EINTR != errno) {
+                qWarning() << "accept error: " << strerror(errno);
+                std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            }
+            continue;
+        }
+
+        bool full = false;
+        {
+            std::lock_guard<std::mutex> locker(mConnLock);
+            full = (mClients.size() >= mLimits.maxConnections);
+            if (!full) {
+                mClients.insert(sock);
+            }
+        }
+        if (full) {
+            qWarning() << "Too many connections, reject new connection, limit: " << mLimits.maxConnections;
+            ::close(sock);
+            continue;
+        }
+
+        // 读写超时, 不发请求的连接不会一直占着名额
+        if (mLimits.idleTimeout > 0) {
+            struct timeval tv = {};
+            tv.tv_sec = mLimits.idleTimeout;
+            setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+            setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        }
+
+        std::thread([this, sock] () {
+            serve(sock);
+            std::lock_guard<std::mutex> locker(mConnLock);
+            mClients.erase(sock);
+            ::close(sock);
+            mConnCond.notify_all();
+        }).detach();
+    }
+
+    // 断开所有连接, 等待连接线程退出
+    std::unique_lock<std::mutex> locker(mConnLock);
+    for (const auto sock : mClients) {
+        ::shutdown(sock, SHUT_RDWR);
+    }
+    mConnCond.wait(locker, [this] () { return mClients.empty(); });
+
+    qInfo() << "Scan service stopped";
+}
+
+void ScanServer::stop()
+{
+    mStop = true;
+    if (mListenFd >= 0) {
+        ::shutdown(mListenFd, SHUT_RDWR);
+    }
+}
+
+std::shared_ptr<ScanServer::RuleSet> ScanServer::loadRules(const QStringList& regs, bool caseSensitive, QString& error)
+{
+    if (regs.isEmpty()) {
+        error = "empty rule set";
+        return nullptr;
+    }
+
+    if (mLimits.maxPatterns > 0 && regs.count() > mLimits.maxPatterns) {
+        error = QString("too many patterns: %1 > %2").arg(regs.count()).arg(mLimits.maxPatterns);
+        qWarning() << error;
+        return nullptr;
+    }
+
+    QByteArray key;
+    {
+        QDataStream out(&key, QIODevice::WriteOnly);
+        out.setVersion(QDataStream::Qt_5_0);
+        out << regs << caseSensitive;
+    }
+    const QByteArray id = QCryptographicHash::hash(key, QCryptographicHash::Sha1);
+
+    auto rules = findRules(id);
+    C_RETURN_VAL_IF_OK(rules, rules);
+
+    rules = std::make_shared<RuleSet>();
+    rules->id = id;
+    rules->flags = HS_FLAG_ALLOWEMPTY | HS_FLAG_UTF8 | HS_FLAG_UCP | HS_FLAG_MULTILINE | HS_FLAG_SOM_LEFTMOST;
+    if (!caseSensitive) {
+        rules->flags |= HS_FLAG_CASELESS;
+    }
+    rules->expressions.reserve(regs.count());
+    for (const auto& reg : regs) {
+        rules->expressions.push_back(reg.toUtf8().toStdString());
+    }
+
+    // 编译不持锁, 同一规则集被并发加载时以先完成的为准
+    beginCompile();
+    const bool compiled = compileRules(*rules, error);
+    endCompile();
+    if (!compiled) {
+        qWarning() << error;
+        return nullptr;
+    }
+
+    std::lock_guard<std::mutex> locker(mLock);
+    auto res = mRuleSets.insert(std::make_pair(id, rules));
+    res.first->second->lastUsed = ++mUseTick;
+    if (res.second) {
+        qInfo() << "Load rule set " << id.toHex() << ", patterns: " << regs.count()
+                << ", database size: " << rules->blockDB.databaseSize()
+                << ", compile time(ms): " << rules->blockDB.compileTimeMs();
+    }
+
+    // 淘汰最久未使用的规则集, 正在扫描的连接持有引用, 扫描结束后才真正释放
+    while (mRuleSets.size() > mMaxRuleSets) {
+        auto oldest = mRuleSets.begin();
+        for (auto it = mRuleSets.begin(); it != mRuleSets.end(); ++it) {
+            if (it->second->lastUsed < oldest->second->lastUsed) {
+                oldest = it;
+            }
+        }
+        qInfo() << "Evict rule set " << oldest->first.toHex();
+        mRuleSets.erase(oldest);
+    }
+
+    return res.first->second;
+}
+
+bool ScanServer::compileRules(RuleSet& rules, QString& error)
+{
+    // 先逐条评估, 有规则无法编译或单条代价已超限时不做整体编译
+    std::size_t streamStateSize = 0;
+    for (const auto& expression : rules.expressions) {
+        const HsPatternCost cost = hsAnalyzePattern(expression, rules.flags & ~HS_FLAG_SOM_LEFTMOST, true);
+        if (!cost.valid) {
+            error = QString("invalid pattern '%1': %2").arg(QString::fromStdString(expression), QString::fromStdString(cost.error));
+            return false;
+        }
+        if (mLimits.maxCompileTimeMs > 0 && cost.compileTimeMs > mLimits.maxCompileTimeMs) {
+            error = QString("pattern '%1' compile time(ms): %2 > %3").arg(QString::fromStdString(expression)).arg(cost.compileTimeMs).arg(mLimits.maxCompileTimeMs);
+            return false;
+        }
+        streamStateSize += cost.streamStateSize;
+    }
+
+    if (mLimits.maxStreamStateSize > 0 && streamStateSize > mLimits.maxStreamStateSize) {
+        error = QString("stream state size: %1 > %2").arg(static_cast<qint64>(streamStateSize)).arg(static_cast<qint64>(mLimits.maxStreamStateSize));
+        return false;
+    }
+
+    // 常驻规则集扫描次数远多于编译, 不分片(每个分片都要多扫一遍)
+    std::string err;
+    if (!rules.blockDB.compile(rules.expressions, std::vector<unsigned int>(), rules.flags, HS_MODE_BLOCK, &err)) {
+        error = QString("compile rules error: %1").arg(err.c_str());
+        return false;
+    }
+
+    if (!checkLimits(rules.blockDB, error)) {
+        rules.blockDB.reset();
+        return false;
+    }
+
+    return true;
+}
+
+bool ScanServer::checkLimits(const HsDatabase& db, QString& error) const
+{
+    if (mLimits.maxDatabaseSize > 0 && db.databaseSize() > mLimits.maxDatabaseSize) {
+        error = QString("database size: %1 > %2").arg(static_cast<qint64>(db.databaseSize())).arg(static_cast<qint64>(mLimits.maxDatabaseSize));
+        return false;
+    }
+
+    if (mLimits.maxStreamStateSize > 0 && db.streamStateSize() > mLimits.maxStreamStateSize) {
+        error = QString("stream state size: %1 > %2").arg(static_cast<qint64>(db.streamStateSize())).arg(static_cast<qint64>(mLimits.maxStreamStateSize));
+        return false;
+    }
+
+    if (mLimits.maxCompileTimeMs > 0 && db.compileTimeMs() > mLimits.maxCompileTimeMs) {
+        error = QString("compile time(ms): %1 > %2").arg(db.compileTimeMs()).arg(mLimits.maxCompileTimeMs);
+        return false;
+    }
+
+    return true;
+}
+
+void ScanServer::beginCompile()
+{
+    std::unique_lock<std::mutex> locker(mCompileLock);
+    mCompileCond.wait(locker, [this] () { return mCompiling < mLimits.maxCompiles; });
+    ++mCompiling;
+}
+
+void ScanServer::endCompile()
+{
+    std::lock_guard<std::mutex> locker(mCompileLock);
+    --mCompiling;
+    mCompileCond.notify_one();
+}
+
+std::shared_ptr<ScanServer::RuleSet> ScanServer::findRules(const QByteArray& id)
+{
+    std::lock_guard<std::mutex> locker(mLock);
+
+    const auto it = mRuleSets.find(id);
+    C_RETURN_VAL_IF_OK(mRuleSets.end() == it, nullptr);
+
+    it->second->lastUsed = ++mUseTick;
+
+    return it->second;
+}
+
+const HsDatabase* ScanServer::streamDatabase(RuleSet& rules, QString& error)
+{
+    std::lock_guard<std::mutex> locker(rules.streamLock);
+
+    if (!rules.streamDB.isValid()) {
+        std::string err;
+        beginCompile();
+        bool compiled = rules.streamDB.compile(rules.expressions, std::vector<unsigned int>(), rules.flags, HS_MODE_STREAM | HS_MODE_SOM_HORIZON_LARGE, &err);
+        endCompile();
+        if (!compiled) {
+            error = QString("compile stream rules error: %1").arg(err.c_str());
+        }
+        else if (!checkLimits(rules.streamDB, error)) {
+            rules.streamDB.reset();
+            compiled = false;
+        }
+        if (!compiled) {
+            qWarning() << error;
+            return nullptr;
+        }
+    }
+
+    return &rules.streamDB;
+}
+
+void ScanServer::serve(int sock)
+{
+    Scratches scratches;
+
+    while (!mStop) {
+        int fd = -1;
+        QByteArray request;
+        if (!scanServiceRecv(sock, request, &fd, SCAN_SERVER_MAX_REQUEST)) {
+            break;
+        }
+
+        const QByteArray response = handleRequest(request, fd, scratches);
+        if (fd >= 0) {
+            ::close(fd);
+        }
+
+        if (!scanServiceSend(sock, response)) {
+            break;
+        }
+    }
+}
+
+QByteArray ScanServer::handleRequest(const QByteArray& request, int fd, Scratches& scratches)
+{
+    quint8 type = 0;
+    QDataStream in(request);
+    in.setVersion(QDataStream::Qt_5_0);
+    in >> type;
+
+    QByteArray response;
+    QDataStream out(&response, QIODevice::WriteOnly);
+    out.setVersion(QDataStream::Qt_5_0);
+
+    if (SCAN_SERVICE_LOAD_RULES == type) {
+        QStringList regs;
+        bool caseSensitive = true;
+        in >> regs >> caseSensitive;
+        C_RETURN_VAL_IF_FAIL(QDataStream::Ok == in.status(), reply_error(SCAN_SERVICE_ERROR, "invalid request"));
+
+        QString error;
+        const auto rules = loadRules(regs, caseSensitive, error);
+        C_RETURN_VAL_IF_FAIL(rules, reply_error(SCAN_SERVICE_ERROR, error));
+
+        out << static_cast<qint32>(SCAN_SERVICE_OK) << QString() << rules->id;
+    }
+    else if (SCAN_SERVICE_SCAN_FD == type || SCAN_SERVICE_SCAN_DATA == type) {
+        QByteArray id;
+        QByteArray data;
+        in >> id;
+        if (SCAN_SERVICE_SCAN_DATA == type) {
+            in >> data;
+        }
+        C_RETURN_VAL_IF_FAIL(QDataStream::Ok == in.status(), reply_error(SCAN_SERVICE_ERROR, "invalid request"));
+        // 更大的数据客户端应通过 memfd 传递
+        C_RETURN_VAL_IF_FAIL(data.size() <= SCAN_SERVICE_INLINE_MAX, reply_error(SCAN_SERVICE_ERROR, "inline data too large"));
+
+        const auto rules = findRules(id);
+        C_RETURN_VAL_IF_FAIL(rules, reply_error(SCAN_SERVICE_UNKNOWN_RULES, "unknown rule set"));
+
+        QString error;
+        QMap<qint64, qint64> matches;
+        if (SCAN_SERVICE_SCAN_FD == type) {
+            C_RETURN_VAL_IF_FAIL(fd >= 0, reply_error(SCAN_SERVICE_ERROR, "missing file descriptor"));
+            C_RETURN_VAL_IF_FAIL(scanFile(rules, scratches, fd, matches, error), reply_error(SCAN_SERVICE_ERROR, error));
+        }
+        else {
+            C_RETURN_VAL_IF_FAIL(scanData(rules, rules->blockDB, scratches, data.constData(), data.size(), matches), reply_error(SCAN_SERVICE_ERROR, "scan error"));
+        }
+
+        out << static_cast<qint32>(SCAN_SERVICE_OK) << QString() << matches;
+    }
+    else {
+        return reply_error(SCAN_SERVICE_ERROR, "unknown request");
+    }
+
+    C_RETURN_VAL_IF_FAIL(response.size() <= SCAN_SERVICE_MAX_PAYLOAD, reply_error(SCAN_SERVICE_ERROR, "too many matches"));
+
+    return response;
+}
+
+bool ScanServer::scanData(const std::shared_ptr<RuleSet>& rules, const HsDatabase& db, Scratches& scratches, const char* data, qint64 len, QMap<qint64, qint64>& matches)
+{
+    C_RETURN_VAL_IF_FAIL(len >= 0 && len <= UINT_MAX, false);
+
+    hs_scratch_t* scratch = scratchFor(rules, db, scratches);
+    C_RETURN_VAL_IF_FAIL(scratch, false);
+
+    auto onMatch = [&matches] (unsigned int, unsigned long long from, unsigned long long to) -> bool {
+        matches.insert(static_cast<qint64>(from), static_cast<qint64>(to));
+        return true;
+    };
+
+    HsScanner<decltype(onMatch)> scanner(db, scratch, onMatch);
+
+    return scanner.scan(data, static_cast<std::size_t>(len));
+}
+
+bool ScanServer::scanFile(const std::shared_ptr<RuleSet>& rules, Scratches& scratches, int fd, QMap<qint64, qint64>& matches, QString& error)
+{
+    struct stat st = {};
+    if (0 != fstat(fd, &st) || !S_ISREG(st.st_mode)) {
+        error = "not a regular file";
+        return false;
+    }
+
+    const qint64 size = static_cast<qint64>(st.st_size);
+    C_RETURN_VAL_IF_OK(0 == size, true);
+
+    // 只有封口的 memfd 能保证扫描过程中不被截断, 可以直接 mmap; 普通文件用 pread 读, 避免 SIGBUS
+    const char* mapped = nullptr;
+#ifdef F_GET_SEALS
+    const int seals = fcntl(fd, F_GET_SEALS);
+    if (seals > 0 && (seals & F_SEAL_SHRINK)) {
+        void* addr = mmap(nullptr, static_cast<std::size_t>(size), PROT_READ, MAP_PRIVATE, fd, 0);
+        if (MAP_FAILED != addr) {
+            mapped = static_cast<const char*>(addr);
+        }
+    }
+#endif
+
+    bool ret = false;
+    if (size <= SCAN_SERVER_BLOCK_SIZE || (mapped && size <= UINT_MAX)) {
+        QByteArray buffer;
+        const char* data = mapped;
+        qint64 len = size;
+        if (!data) {
+            buffer.resize(static_cast<int>(size));
+            len = ::pread(fd, buffer.data(), buffer.size(), 0);
+            data = buffer.constData();
+        }
+        ret = len >= 0 && scanData(rules, rules->blockDB, scratches, data, len, matches);
+        if (!ret) {
+            error = "scan error";
+        }
+    }
+    else {
+        const HsDatabase* db = streamDatabase(*rules, error);
+        hs_scratch_t* scratch = db ? scratchFor(rules, *db, scratches) : nullptr;
+        if (scratch) {
+            auto onMatch = [&matches] (unsigned int, unsigned long long from, unsigned long long to) -> bool {
+                matches.insert(static_cast<qint64>(from), static_cast<qint64>(to));
+                return true;
+            };
+
+            HsScanner<decltype(onMatch)> scanner(*db, scratch, onMatch);
+            ret = scanner.openStream();
+
+            QByteArray buffer;
+            for (qint64 pos = 0; ret && pos < size;) {
+                const char* data = nullptr;
+                qint64 len = qMin<qint64>(SCAN_SERVER_BLOCK_SIZE, size - pos);
+                if (mapped) {
+                    data = mapped + pos;
+                }
+                else {
+                    buffer.resize(static_cast<int>(len));
+                    len = ::pread(fd, buffer.data(), buffer.size(), pos);
+                    // 文件在扫描过程中被截断, 只扫描已读到的部分
+                    if (len <= 0) {
+                        break;
+                    }
+                    data = buffer.constData();
+                }
+                ret = scanner.scanStream(data, static_cast<std::size_t>(len));
+                pos += len;
+            }
+            ret = ret && scanner.closeStream();
+            if (!ret) {
+                error = "stream scan error";
+            }
+        }
+        else if (error.isEmpty()) {
+            error = "alloc scratch error";
+        }
+    }
+
+    if (mapped) {
+        munmap(const_cast<char*>(mapped), static_cast<std::size_t>(size));
+    }
+
+    return ret;
+}
+
+static QByteArray reply_error(qint32 status, const QString& error)
+{
+    QByteArray response;
+    QDataStream out(&response, QIODevice::WriteOnly);
+    out.setVersion(QDataStream::Qt_5_0);
+    out << status << error;
+
+    return response;
+}
+
+hs_scratch_t* ScanServer::scratchFor(const std::shared_ptr<RuleSet>& rules, const HsDatabase& db, Scratches& scratches)
+{
+    // 先清掉已被淘汰的规则集的 scratch
+    for (auto it = scratches.begin(); it != scratches.end();) {
+        it = it->second.owner.expired() ? scratches.erase(it) : std::next(it);
+    }
+
+    auto it = scratches.find(&db);
+    if (scratches.end() == it || it->second.owner.lock() != rules) {
+        ScratchEntry entry;
+        entry.owner = rules;
+        entry.scratch.reset(new HsScratch(db));
+        C_RETURN_VAL_IF_FAIL(entry.scratch->isValid(), nullptr);
+        scratches.erase(&db);
+        it = scratches.insert(std::make_pair(&db, std::move(entry))).first;
+    }
+
+    return it->second.scratch->get();
+}
@@ -0,0 +1,117 @@
+//
+// Created by dingjing on 10/18/26.
+//
+
+#ifndef hs_wrap_SCAN_SERVER_H
+#define hs_wrap_SCAN_SERVER_H
+#include <map>
+#include <mutex>
+#include <memory>
+#include <set>
+#include <atomic>
+#include <condition_variable>
+#include <qmap.h>
+#include <QString>
+#include <QByteArray>
+#include <QStringList>
+
+#include "hs-engine.h"
+
+
+#define SCAN_SERVER_MAX_RULE_SETS   32              // 常驻的规则集上限
+#define SCAN_SERVER_SOCKET_MODE     0660            // 套接字文件权限, 只允许属主与同组进程连接
+#define SCAN_SERVER_MAX_REQUEST     (16 << 20)      // 请求帧上限, 最大的请求是加载规则集
+
+
+/**
+ * 服务端资源上限, 防止单个客户端耗尽守护进程; 规则集代价各项为 0 表示不限制
+ */
+struct ScanServerLimits
+{
+    std::size_t     maxConnections = 64;            // 同时服务的连接数, 超出的连接直接关闭
+    std::size_t     maxCompiles = 2;                // 同时编译的规则集数, 超出的加载请求排队等待
+    int             idleTimeout = 60;               // 连接上读写超时(秒), 空闲连接超时后关闭, 客户端下次请求时自动重连
+    int             maxPatterns = 50000;            // 单个规则集的规则数
+    std::size_t     maxDatabaseSize = (512 << 20);
+    std::size_t     maxStreamStateSize = (1 << 20); // 每个流的状态大小
+    double          maxCompileTimeMs = 30000;       // 单条规则评估及整个规则集编译的耗时
+};
+
+
+/**
+ * 本地扫描服务端
+ *  相同规则集(规则列表 + 大小写敏感)只编译一次, 所有连接共用同一个只读数据库, 每个连接线程各自克隆 scratch.
+ *  块模式数据库在加载规则时编译; 流模式数据库只在第一次扫描大文件时编译.
+ *  常驻规则集超过上限时淘汰最久未使用的, 客户端再用到时收到 SCAN_SERVICE_UNKNOWN_RULES 后重新加载.
+ *  加载规则时先逐条评估代价, 再编译整个规则集并检查 ScanServerLimits, 超出上限的规则集直接拒绝.
+ */
+class ScanServer final
+{
+public:
+    explicit ScanServer(const QString& socketPath, int maxRuleSets=SCAN_SERVER_MAX_RULE_SETS, int socketMode=SCAN_SERVER_SOCKET_MODE, const ScanServerLimits& limits=ScanServerLimits());
+    ~ScanServer();
+    ScanServer(const ScanServer&) = delete;
+    ScanServer& operator= (const ScanServer&) = delete;
+
+    bool listen();
+    // 阻塞处理连接, stop() 后等所有连接结束再返回
+    void run();
+    // 只做异步信号安全的操作, 可以在信号处理函数中调用
+    void stop();
+
+private:
+    struct RuleSet
+    {
+        QByteArray                  id;
+        std::vector<std::string>    expressions;
+        unsigned int                flags = 0;
+        HsDatabase                  blockDB;
+        std::mutex                  streamLock;
+        HsDatabase                  streamDB;
+        quint64                     lastUsed = 0;       // 受 mLock 保护
+    };
+    // 规则集被淘汰后数据库地址可能被复用, 同时记下所属规则集, 失效的 scratch 不再使用
+    struct ScratchEntry
+    {
+        std::weak_ptr<RuleSet>      owner;
+        std::unique_ptr<HsScratch>  scratch;
+    };
+    typedef std::map<const HsDatabase*, ScratchEntry> Scratches;
+
+    std::shared_ptr<RuleSet> loadRules(const QStringList& regs, bool caseSensitive, QString& error);
+    bool compileRules(RuleSet& rules, QString& error);
+    bool checkLimits(const HsDatabase& db, QString& error) const;
+    void beginCompile();
+    void endCompile();
+    std::shared_ptr<RuleSet> findRules(const QByteArray& id);
+    const HsDatabase* streamDatabase(RuleSet& rules, QString& error);
+
+    void serve(int sock);
+    QByteArray handleRequest(const QByteArray& request, int fd, Scratches& scratches);
+    bool scanData(const std::shared_ptr<RuleSet>& rules, const HsDatabase& db, Scratches& scratches, const char* data, qint64 len, QMap<qint64, qint64>& matches);
+    bool scanFile(const std::shared_ptr<RuleSet>& rules, Scratches& scratches, int fd, QMap<qint64, qint64>& matches, QString& error);
+    static hs_scratch_t* scratchFor(const std::shared_ptr<RuleSet>& rules, const HsDatabase& db, Scratches& scratches);
+
+private:
+    QString                                             mSocketPath;
+    int                                                 mListenFd = -1;
+    int                                                 mSocketMode;
+    std::size_t                                         mMaxRuleSets;
+    ScanServerLimits                                    mLimits;
+    std::atomic<bool>                                   mStop;
+
+    std::mutex                                          mLock;
+    std::map<QByteArray, std::shared_ptr<RuleSet>>      mRuleSets;
+    quint64                                             mUseTick = 0;
+
+    std::mutex                                          mConnLock;
+    std::condition_variable                             mConnCond;
+    std::set<int>                                       mClients;           // 正在服务的连接
+
+    std::mutex                                          mCompileLock;
+    std::condition_variable                             mCompileCond;
+    std::size_t                                         mCompiling = 0;     // 正在编译的规则集数
+};
+
+
+#endif // hs_wrap_SCAN_SERVER_H
@@ -0,0 +1,449 @@
+//
+// Created by dingjing on 10/18/26.
+//
+// hyperscan 核心封装, 仅依赖 hyperscan 与标准库, 全部实现在头文件中.
+// 匹配回调以模板参数 Handler 传入, 可被编译器内联, 不需要 Qt/moc, 块模式扫描没有堆分配.
+//
+// Handler 需要满足:
+//      bool operator() (unsigned int id, unsigned long long from, unsigned long long to);
+// 返回 false 表示停止扫描.
+//
+
+#ifndef hs_wrap_HS_ENGINE_H
+#define hs_wrap_HS_ENGINE_H
+#include <string>
+#include <vector>
+#include <cstddef>
+#include <cstdlib>
+#include <chrono>
+#include <climits>
+#include <atomic>
+#include <thread>
+#include <algorithm>
+#include <hs/hs.h>
+
+#define HS_SHARD_MIN_PATTERNS       1000        // 每个分片至少包含的规则数
+
+
+class HsDatabase final
+{
+public:
+    HsDatabase() = default;
+    ~HsDatabase() { reset(); }
+    HsDatabase(const HsDatabase&) = delete;
+    HsDatabase& operator= (const HsDatabase&) = delete;
+
+    // ids 为空时: 单条规则 id 为 0, 多条规则 id 依次为 1, 2, 3...
+    // maxShards > 1 且规则较多时按 字面量/普通正则/代价高的正则 分组切成多个分片, 多线程并行编译;
+    // 所有分片共用一个 scratch, 扫描时依次匹配各分片, 对外仍是一个数据库, id 全局唯一.
+    // 每个分片都要单独扫描一遍数据, n 个分片的扫描耗时约为不分片的 n 倍, 只适合编译耗时比扫描更重要的场景
+    bool compile(const std::vector<std::string>& expressions, const std::vector<unsigned int>& ids, unsigned int flags, unsigned int mode, std::string* error=nullptr, unsigned int maxShards=1);
+    void reset();
+
+    bool isValid() const { return !mDBs.empty() && mScratch; }
+    unsigned int mode() const { return mMode; }
+    unsigned int maxWidth() const { return mMaxWidth; }    // 所有规则最大匹配宽度, 无上限时为 UINT_MAX
+    std::size_t shardCount() const { return mDBs.size(); }
+    std::size_t databaseSize() const;
+    std::size_t streamStateSize() const;                // 非流模式为 0
+    double compileTimeMs() const { return mCompileMs; }
+    const std::vector<hs_database_t*>& databases() const { return mDBs; }
+    hs_scratch_t* scratch() const { return mScratch; }
+
+private:
+    std::vector<hs_database_t*> mDBs;
+    hs_scratch_t*               mScratch = nullptr;
+    unsigned int                mMode = 0;
+    unsigned int                mMaxWidth = UINT_MAX;
+    double                      mCompileMs = 0;
+};
+
+// 单条规则的代价, 用于接受规则前评估
+struct HsPatternCost
+{
+    bool                        valid = false;          // hyperscan 能否编译
+    std::string                 error;
+    unsigned int                minWidth = 0;
+    unsigned int                maxWidth = UINT_MAX;    // UINT_MAX 表示无上限
+    bool                        needSom = false;        // 要起始位置时是否必须 SOM(变长规则无法由结束位置推出起点)
+    std::size_t                 blockDatabaseSize = 0;
+    std::size_t                 streamDatabaseSize = 0;
+    std::size_t                 streamStateSize = 0;
+    double                      compileTimeMs = 0;      // 块模式与流模式编译耗时之和
+};
+
+// 每个扫描线程需要独立的 scratch, 从数据库自带的 scratch 克隆
+class HsScratch final
+{
+public:
+    explicit HsScratch(const HsDatabase& db)
+    {
+        if (db.scratch() && HS_SUCCESS != hs_clone_scratch(db.scratch(), &mScratch)) {
+            mScratch = nullptr;
+        }
+    }
+    ~HsScratch() { if (mScratch) { hs_free_scratch(mScratch); } }
+    HsScratch(const HsScratch&) = delete;
+    HsScratch& operator= (const HsScratch&) = delete;
+
+    bool isValid() const { return nullptr != mScratch; }
+    hs_scratch_t* get() const { return mScratch; }
+
+private:
+    hs_scratch_t*               mScratch = nullptr;
+};
+
+template <typename Handler>
+class HsScanner final
+{
+public:
+    HsScanner(const HsDatabase& db, hs_scratch_t* scratch, Handler& handler)
+        : mDB(db), mScratch(scratch), mHandler(handler) {}
+    ~HsScanner() { closeStream(); }
+    HsScanner(const HsScanner&) = delete;
+    HsScanner& operator= (const HsScanner&) = delete;
+
+    // 块模式
+    bool scan(const char* data, std::size_t len);
+
+    // 流模式
+    bool openStream();
+    bool scanStream(const char* data, std::size_t len);
+    bool resetStream();
+    bool closeStream();
+
+private:
+    static int onMatch (unsigned int id, unsigned long long from, unsigned long long to, unsigned int flags, void* ctx)
+    {
+        (void) flags;
+        return (*static_cast<Handler*>(ctx))(id, from, to) ? 0 : 1;
+    }
+
+private:
+    const HsDatabase&           mDB;
+    hs_scratch_t*               mScratch = nullptr;
+    Handler&                    mHandler;
+    std::vector<hs_stream_t*>   mStreams;               // 每个分片一个流
+};
+
+// 块模式扫描一段内存
+template <typename Handler>
+inline bool hsScan(const HsDatabase& db, const char* data, std::size_t len, Handler& handler)
+{
+    HsScanner<Handler> scanner(db, db.scratch(), handler);
+    return scanner.scan(data, len);
+}
+
+// 查询规则可匹配的最短/最长字节数, 最长无上限时为 UINT_MAX
+inline bool hsExpressionWidth(const std::string& expression, unsigned int flags, unsigned int* minWidth, unsigned int* maxWidth, std::string* error=nullptr)
+{
+    hs_expr_info_t* info = nullptr;
+    hs_compile_error_t* hsCompileErr = nullptr;
+    if (HS_SUCCESS != hs_expression_info(expression.c_str(), flags, &info, &hsCompileErr)) {
+        if (error) { *error = (hsCompileErr && hsCompileErr->message) ? hsCompileErr->message : "unknown error"; }
+        hs_free_compile_error(hsCompileErr);
+        return false;
+    }
+
+    if (minWidth) { *minWidth = info->min_width; }
+    if (maxWidth) { *maxWidth = info->max_width; }
+    std::free(info);
+
+    return true;
+}
+
+// 分别以块模式和流模式编译单条规则, 统计宽度、数据库大小、流状态大小与编译耗时
+inline HsPatternCost hsAnalyzePattern(const std::string& expression, unsigned int flags, bool som)
+{
+    HsPatternCost cost;
+    if (!hsExpressionWidth(expression, flags, &cost.minWidth, &cost.maxWidth, &cost.error)) {
+        return cost;
+    }
+    cost.needSom = som && cost.minWidth != cost.maxWidth;
+
+    const std::vector<std::string> expressions(1, expression);
+    const unsigned int compileFlags = som ? (flags | HS_FLAG_SOM_LEFTMOST) : flags;
+
+    HsDatabase block;
+    if (!block.compile(expressions, std::vector<unsigned int>(), compileFlags, HS_MODE_BLOCK, &cost.error)) {
+        return cost;
+    }
+
+    HsDatabase stream;
+    if (!stream.compile(expressions, std::vector<unsigned int>(), compileFlags, som ? (HS_MODE_STREAM | HS_MODE_SOM_HORIZON_LARGE) : HS_MODE_STREAM, &cost.error)) {
+        return cost;
+    }
+
+    cost.valid = true;
+    cost.blockDatabaseSize = block.databaseSize();
+    cost.streamDatabaseSize = stream.databaseSize();
+    cost.streamStateSize = stream.streamStateSize();
+    cost.compileTimeMs = block.compileTimeMs() + stream.compileTimeMs();
+
+    return cost;
+}
+
+// 0: 字面量, 1: 普通正则, 2: 含重复的正则, 编译代价最高
+inline int hsPatternClass(const std::string& expression)
+{
+    if (std::string::npos == expression.find_first_of("\\^$.|?*+()[]{}")) {
+        return 0;
+    }
+
+    return (std::string::npos == expression.find_first_of("*+{")) ? 1 : 2;
+}
+
+// 把规则下标按类别(字面量/普通正则/代价高的正则)排列后按加权代价切成 min(maxShards, 规则数 / HS_SHARD_MIN_PATTERNS) 个分片,
+// 代价高的规则按 4 倍权重计, 每片至少 HS_SHARD_MIN_PATTERNS 条; 规则少的类别并入相邻分片
+inline void hsSplitShards(const std::vector<std::string>& expressions, unsigned int maxShards, std::vector<std::vector<std::size_t>>& shards)
+{
+    shards.clear();
+
+    const std::size_t num = expressions.size();
+    const std::size_t total = std::min<std::size_t>(maxShards, num / HS_SHARD_MIN_PATTERNS);
+    if (total <= 1) {
+        shards.resize(1);
+        for (std::size_t i = 0; i < num; ++i) {
+            shards[0].push_back(i);
+        }
+        return;
+    }
+
+    static const std::size_t weights[3] = { 1, 1, 4 };
+    std::vector<std::size_t> groups[3];
+    for (std::size_t i = 0; i < num; ++i) {
+        groups[hsPatternClass(expressions[i])].push_back(i);
+    }
+
+    std::size_t weightSum = 0;
+    for (int g = 0; g < 3; ++g) {
+        weightSum += groups[g].size() * weights[g];
+    }
+
+    // 累计权重达到下一个等分点时切分; 剩余规则只够后面每片 HS_SHARD_MIN_PATTERNS 条时必须切分,
+    // 保证正好切出 total 片, 每片都不少于 HS_SHARD_MIN_PATTERNS 条
+    std::size_t weight = 0;
+    std::size_t consumed = 0;
+    std::vector<std::size_t> cur;
+    for (int g = 0; g < 3; ++g) {
+        for (const auto idx : groups[g]) {
+            cur.push_back(idx);
+            weight += weights[g];
+            ++consumed;
+
+            const std::size_t rest = total - shards.size() - 1;        // 本片之后还要切出的片数
+            if (rest > 0 && cur.size() >= HS_SHARD_MIN_PATTERNS && num - consumed >= rest * HS_SHARD_MIN_PATTERNS
+                && (weight * total >= weightSum * (shards.size() + 1) || num - consumed == rest * HS_SHARD_MIN_PATTERNS)) {
+                shards.push_back(std::move(cur));
+                cur.clear();
+            }
+        }
+    }
+
+    if (!cur.empty()) {
+        shards.push_back(std::move(cur));
+    }
+}
+
+
+inline bool HsDatabase::compile(const std::vector<std::string>& expressions, const std::vector<unsigned int>& ids, unsigned int flags, unsigned int mode, std::string* error, unsigned int maxShards)
+{
+    reset();
+
+    if (expressions.empty()) {
+        if (error) { *error = "empty expressions"; }
+        return false;
+    }
+
+    const std::size_t num = expressions.size();
+    std::vector<std::vector<std::size_t>> shards;
+    hsSplitShards(expressions, maxShards, shards);
+
+    std::vector<hs_database_t*> dbs(shards.size(), nullptr);
+    std::vector<std::string> errors(shards.size());
+    std::vector<unsigned int> widths(shards.size(), 0);
+    std::atomic<std::size_t> next(0);
+
+    auto worker = [&] () {
+        for (std::size_t s = next++; s < shards.size(); s = next++) {
+            const std::vector<std::size_t>& shard = shards[s];
+            std::vector<const char*> regStr(shard.size());
+            std::vector<unsigned int> regIds(shard.size());
+            std::vector<unsigned int> regFlags(shard.size(), flags);
+            for (std::size_t i = 0; i < shard.size(); ++i) {
+                const std::size_t idx = shard[i];
+                regStr[i] = expressions[idx].c_str();
+                regIds[i] = (ids.size() == num) ? ids[idx] : ((1 == num) ? 0 : static_cast<unsigned int>(idx + 1));
+
+                unsigned int width = UINT_MAX;
+                hsExpressionWidth(expressions[idx], flags, nullptr, &width);
+                widths[s] = std::max(widths[s], width);
+            }
+
+            hs_compile_error_t* hsCompileErr = nullptr;
+            if (HS_SUCCESS != hs_compile_multi(regStr.data(), regFlags.data(), regIds.data(), static_cast<unsigned int>(shard.size()), mode, nullptr, &dbs[s], &hsCompileErr)) {
+                errors[s] = (hsCompileErr && hsCompileErr->message) ? hsCompileErr->message : "unknown error";
+                hs_free_compile_error(hsCompileErr);
+                dbs[s] = nullptr;
+            }
+        }
+    };
+
+    const auto begin = std::chrono::steady_clock::now();
+    if (shards.size() <= 1) {
+        worker();
+    }
+    else {
+        std::vector<std::thread> threads;
+        for (std::size_t i = 0; i < std::min<std::size_t>(shards.size(), maxShards); ++i) {
+            threads.emplace_back(worker);
+        }
+        for (auto& t : threads) {
+            t.join();
+        }
+    }
+    mCompileMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+
+    mDBs = dbs;
+    mMode = mode;
+    mMaxWidth = 0;
+    for (std::size_t s = 0; s < shards.size(); ++s) {
+        if (!dbs[s]) {
+            if (error) { *error = errors[s]; }
+            reset();
+            return false;
+        }
+        mMaxWidth = std::max(mMaxWidth, widths[s]);
+    }
+
+    // 同一个 scratch 依次为每个分片分配, 最终能满足所有分片
+    for (const auto db : mDBs) {
+        if (HS_SUCCESS != hs_alloc_scratch(db, &mScratch)) {
+            if (error) { *error = "error allocating scratch"; }
+            reset();
+            return false;
+        }
+    }
+
+    return true;
+}
+
+inline void HsDatabase::reset()
+{
+    if (mScratch) { hs_free_scratch(mScratch); mScratch = nullptr; }
+    for (const auto db : mDBs) {
+        if (db) { hs_free_database(db); }
+    }
+    mDBs.clear();
+    mMode = 0;
+    mMaxWidth = UINT_MAX;
+    mCompileMs = 0;
+}
+
+inline std::size_t HsDatabase::databaseSize() const
+{
+    std::size_t total = 0;
+    for (const auto db : mDBs) {
+        std::size_t size = 0;
+        if (HS_SUCCESS == hs_database_size(db, &size)) {
+            total += size;
+        }
+    }
+
+    return total;
+}
+
+inline std::size_t HsDatabase::streamStateSize() const
+{
+    std::size_t total = 0;
+    for (const auto db : mDBs) {
+        std::size_t size = 0;
+        if ((mMode & HS_MODE_STREAM) && HS_SUCCESS == hs_stream_size(db, &size)) {
+            total += size;
+        }
+    }
+
+    return total;
+}
+
+template <typename Handler>
+inline bool HsScanner<Handler>::scan(const char* data, std::size_t len)
+{
+    for (const auto db : mDB.databases()) {
+        const hs_error_t err = hs_scan(db, data, static_cast<unsigned int>(len), 0, mScratch, onMatch, &mHandler);
+        if (HS_SCAN_TERMINATED == err) {
+            return true;
+        }
+        if (HS_SUCCESS != err) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+template <typename Handler>
+inline bool HsScanner<Handler>::openStream()
+{
+    closeStream();
+
+    for (const auto db : mDB.databases()) {
+        hs_stream_t* stream = nullptr;
+        if (HS_SUCCESS != hs_open_stream(db, 0, &stream)) {
+            closeStream();
+            return false;
+        }
+        mStreams.push_back(stream);
+    }
+
+    return !mStreams.empty();
+}
+
+template <typename Handler>
+inline bool HsScanner<Handler>::scanStream(const char* data, std::size_t len)
+{
+    if (mStreams.empty()) { return false; }
+
+    for (const auto stream : mStreams) {
+        const hs_error_t err = hs_scan_stream(stream, data, static_cast<unsigned int>(len), 0, mScratch, onMatch, &mHandler);
+        if (HS_SUCCESS != err && HS_SCAN_TERMINATED != err) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// 流结束处的匹配先回调, 之后流内偏移从 0 重新开始
+template <typename Handler>
+inline bool HsScanner<Handler>::resetStream()
+{
+    if (mStreams.empty()) { return openStream(); }
+
+    for (const auto stream : mStreams) {
+        const hs_error_t err = hs_reset_stream(stream, 0, mScratch, onMatch, &mHandler);
+        if (HS_SUCCESS != err && HS_SCAN_TERMINATED != err) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+template <typename Handler>
+inline bool HsScanner<Handler>::closeStream()
+{
+    bool ret = true;
+
+    // 流结束时仍可能有匹配(如 $), 需要回调
+    for (const auto stream : mStreams) {
+        const hs_error_t err = hs_close_stream(stream, mScratch, onMatch, &mHandler);
+        ret = ret && (HS_SUCCESS == err || HS_SCAN_TERMINATED == err);
+    }
+    mStreams.clear();
+
+    return ret;
+}
+
+
+#endif // hs_wrap_HS_ENGINE_H
@@ -5,11 +5,21 @@
 #include "regex-matcher.h"
 
 #include <QFile>
+#include <QSet>
 #include <QDebug>
+#include <QThread>
 #include <QRegExp>
-#include <hs/hs.h>
+#include <QCryptographicHash>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <climits>
+#include <cstring>
+#include <algorithm>
 #include <opencc.h>
 
+#include "hs-engine.h"
+#include "scan-cache.h"
 #include "macros/macros.h"
 
 
@@ -18,39 +28,116 @@ static QString chineseTraditionToSimple(const QString& str);
 static QString validUtf8String(const char* data, int dataLen);
 static QString validUtf8String(const QString& data);
 
+#define PARALLEL_CHUNK_SIZE     (64 << 20)
+#define LINE_CONTEXT_MAX        512             // 行上下文在匹配前后各最多保留的字节数
+#define NO_SOM_RECOVER_WINDOW   (4 << 10)       // 不带 SOM 时回溯起始位置最多向前查找的字节数
+
+struct LineInfo
+{
+    qint64          line;                       // 行号, 从 1 开始
+    qint64          start;                      // text 在原数据中的偏移
+    QByteArray      text;
+};
+
+// 并行扫描各线程收集的匹配
+struct ChunkMatch
+{
+    qint64          start;                      // 不带 SOM 时与 end 相同
+    qint64          end;
+    unsigned int    id;
+};
+
+static int resolve_lines(const char* data, qint64 dataStart, qint64 len, qint64 linesBefore, const QVector<qint64>& ends, bool eof, QMap<qint64, LineInfo>& out);
+static bool line_context(const LineInfo& line, qint64 s, qint64 e, QPair<QString, QString>& pair);
+static QPair<QString, QString> file_context(QFile& file, qint64 s, qint64 e);
+
+/**
+ * 流式扫描时计算匹配所在行: 只保留尚未处理的匹配需要的数据, 已丢弃部分的换行数累计在 mLinesBefore
+ */
+class LineTracker
+{
+public:
+    void append(const char* data, qint64 len);
+    void addMatch(qint64 end);
+    void resolve(bool eof, QMap<qint64, LineInfo>& out);
+
+private:
+    QByteArray                  mWindow;
+    qint64                      mWinStart = 0;
+    qint64                      mLinesBefore = 0;
+    QVector<qint64>             mPending;
+};
 
-static int hyper_scan_match_cb (unsigned int id, unsigned long long from, unsigned long long to, unsigned int flags, void* ctx);
 
 class RegexMatcherPrivate
 {
     Q_DECLARE_PUBLIC(RegexMatcher);
-    friend int hyper_scan_match_cb (unsigned int id, unsigned long long from, unsigned long long to, unsigned int flags, void* ctx);
 public:
     explicit RegexMatcherPrivate(RegexMatcher* q, qint64 blockSize);
     ~RegexMatcherPrivate();
 
+    unsigned int compileFlags() const;
     bool compileHyperScan(int mode=HS_MODE_BLOCK);
+    bool compileRecoverDatabase();
+    void applyCostLimits();
+    bool checkCostLimits(const HsDatabase& db) const;
     bool matchHyperScan(const QString& lineBuf);
     bool matchHyperScan(QFile& file);
+    bool matchHyperScanParallel(QFile& file);
+    bool matchHyperScan(const QByteArray& records, const QVector<qint64>& offsets, QVector<RegexMatcher::BatchMatch>& results);
 
     bool matchRegexp(QFile& file);
     bool matchRegexp(const QString& lineBuf);
     qint64 doMatchRegexp(const QString& lineBuf, const QRegExp& regexp, const qint64 offset=0);
 
     void addMatchPos(quint64 start, quint64 end);
+    void addMatchEnd(quint64 end, unsigned int id);
+    void clearMatchResult();
     bool alreadyMatched() const;
 
+    void resolveMatchStarts();
+    void resolveMatchLines(const QByteArray& data);
+    void resolveMatchLines(QFile& file);
+
+    QByteArray ruleSetHash() const;
+    bool lookupScanCache(const QString& filePath);
+    void storeScanCache(const QString& filePath, const ScanCache::FileStat& before);
+    qint64 recoverMatchStart(const QByteArray& window, qint64 lowest, unsigned int id);
+
 private:
     RegexMatcher*               q_ptr = nullptr;
     bool                        mCaseSensitive = false;
     bool                        mTwMainlandSensitive = false;
-    QSet<QString>               mRegxStrings;
-    hs_database_t*              mHsDB = nullptr;
-    hs_scratch_t*               mScratch = nullptr;
+    QStringList                 mRegxStrings;
+    std::vector<unsigned int>   mRegxIds;           // 与 mRegxStrings 一一对应: 调用者列表中的下标 + 1, 单条规则构造时为 0
+    HsDatabase                  mBlockDB;
+    HsDatabase                  mStreamDB;
+
+    bool                        mNoSom = false;             // 实际使用的模式, setCostLimits() 时超出代价上限可能被改为 true
+    bool                        mRequestedNoSom = false;    // setNoSomMode() 设置的模式
+    bool                        mStartsResolved = true;
+    unsigned int                mMaxWidth = UINT_MAX;  // 所有规则最大匹配宽度(字节)
 
     qint64                      mBlockSize;
+    int                         mCompileShards = 1;
+    qint64                      mParallelMinSize = (256 << 20);
+    int                         mParallelThreads = 0;
+    TextFilterMode              mTextFilter = TEXT_FILTER_NONE;
 
     QMap<qint64, qint64>        mMatchRes;
+    QMultiMap<qint64, unsigned int> mMatchIds;      // 不带 SOM 时 结束位置 -> 规则 id, 回溯起点只认同一条规则
+
+    HsDatabase                  mRecoverDB;         // 回溯起点用: 命中过的规则前加一个任意字符, 断言能看到真实的前一个字符
+    QSet<unsigned int>          mRecoverIds;        // mRecoverDB 包含的规则
+
+    ScanCache*                  mScanCache = nullptr;
+    QMap<qint64, QPair<QString, QString>> mCachedContexts;
+
+    bool                        mLineReport = false;
+    QMap<qint64, LineInfo>      mLineInfo;          // 结束位置 -> 所在行
+
+    RegexMatcher::CostLimits    mCostLimits;
+    bool                        mRejected = false;  // 规则集超出资源上限
 
     // 上下文
     QString                     mContext;           // 检查的字符串/或文件路径
@@ -63,65 +150,133 @@ RegexMatcherPrivate::RegexMatcherPrivate(RegexMatcher* q, qint64 blockSize)
 
 RegexMatcherPrivate::~RegexMatcherPrivate()
 {
-    C_FREE_FUNC(mScratch, hs_free_scratch);
-    C_FREE_FUNC(mHsDB, hs_free_database);
 }
 
-bool RegexMatcherPrivate::compileHyperScan(int mode)
+unsigned int RegexMatcherPrivate::compileFlags() const
 {
-    C_RETURN_VAL_IF_OK(mRegxStrings.isEmpty(), false);
-    C_RETURN_VAL_IF_OK(mHsDB && mScratch, true);
-
-    int flags = HS_FLAG_SOM_LEFTMOST | HS_FLAG_ALLOWEMPTY | HS_FLAG_UTF8 | HS_FLAG_UCP | HS_FLAG_MULTILINE;
+    unsigned int flags = HS_FLAG_ALLOWEMPTY | HS_FLAG_UTF8 | HS_FLAG_UCP | HS_FLAG_MULTILINE;
     if (!mCaseSensitive) {
         flags |= HS_FLAG_CASELESS;
     }
 
-    if (HS_MODE_STREAM == mode) {
-        mode |= HS_MODE_SOM_HORIZON_LARGE;
+    return flags;
+}
+
+bool RegexMatcherPrivate::compileHyperScan(int mode)
+{
+    C_RETURN_VAL_IF_OK(mRegxStrings.isEmpty() || mRejected, false);
+
+    HsDatabase& db = (HS_MODE_STREAM == mode) ? mStreamDB : mBlockDB;
+    C_RETURN_VAL_IF_OK(db.isValid(), true);
+
+    unsigned int flags = compileFlags();
+    if (!mNoSom) {
+        flags |= HS_FLAG_SOM_LEFTMOST;
+        if (HS_MODE_STREAM == mode) {
+            mode |= HS_MODE_SOM_HORIZON_LARGE;
+        }
     }
 
-    hs_compile_error_t* hsCompileErr = nullptr;
+    std::vector<std::string> expressions;
+    expressions.reserve(mRegxStrings.count());
+    for (auto it = mRegxStrings.constBegin(); it != mRegxStrings.constEnd(); ++it) {
+        expressions.push_back(it->toUtf8().toStdString());
+    }
 
-    if (1 == mRegxStrings.count()) {
-        const hs_error_t err = hs_compile(mRegxStrings.constBegin()->toUtf8().constData(), flags, mode, nullptr, &mHsDB, &hsCompileErr);
-        if (HS_SUCCESS != err) {
-            qWarning() << "Error compiling HS regex: " << *mRegxStrings.constBegin() << ", error: " << hsCompileErr->message;
-            hs_free_compile_error(hsCompileErr);
-            return false;
+    const unsigned int maxShards = static_cast<unsigned int>(mCompileShards > 0 ? mCompileShards : qMax(1, QThread::idealThreadCount()));
+
+    std::string error;
+    if (!db.compile(expressions, mRegxIds, flags, mode, &error, maxShards)) {
+        qWarning() << "Error compiling HS regex: " << mRegxStrings.join("{]") << ", error: " << error.c_str();
+        return false;
+    }
+    mMaxWidth = db.maxWidth();
+
+    return true;
+}
+
+bool RegexMatcherPrivate::compileRecoverDatabase()
+{
+    QSet<unsigned int> ids = mRecoverIds;
+    for (auto it = mMatchIds.constBegin(); it != mMatchIds.constEnd(); ++it) {
+        ids.insert(it.value());
+    }
+    C_RETURN_VAL_IF_OK(ids == mRecoverIds, mRecoverDB.isValid());
+
+    // 只编译命中过的规则, 新命中的规则出现时连同已有的重新编译
+    mRecoverIds = ids;
+    std::vector<std::string> expressions;
+    std::vector<unsigned int> regIds;
+    for (int i = 0; i < mRegxStrings.count(); ++i) {
+        if (ids.contains(mRegxIds[i])) {
+            expressions.push_back(QString("(?s:.)(?:%1)").arg(mRegxStrings.at(i)).toUtf8().toStdString());
+            regIds.push_back(mRegxIds[i]);
         }
     }
-    else {
-        int idx = 0;
-        const int num = mRegxStrings.count();
-        const auto regStr = new char*[num + 1];
-        const auto regIds = new unsigned int[num + 1];
-        const auto regFlags = new unsigned int[num + 1];
-        for (auto it = mRegxStrings.constBegin(); it != mRegxStrings.constEnd(); ++it) {
-            regStr[idx] = const_cast<char*>(it->toUtf8().constData());
-            regIds[idx] = idx + 1;
-            regFlags[idx] = flags;
-            ++idx;
-        }
-
-        const hs_error_t err = hs_compile_multi(regStr, regFlags, regIds, num, mode, nullptr, &mHsDB, &hsCompileErr);
-        if (HS_SUCCESS != err) {
-            qWarning() << "Error compiling HS regex: " << mRegxStrings.toList().join("{]") << ", error: " << hsCompileErr->message;
-            hs_free_compile_error(hsCompileErr);
-            delete regStr;
-            delete regIds;
-            delete regFlags;
+
+    std::string error;
+    if (!mRecoverDB.compile(expressions, regIds, compileFlags(), HS_MODE_BLOCK, &error)) {
+        qWarning() << "Error compiling HS regex for match start recovery, error: " << error.c_str();
+        return false;
+    }
+
+    return true;
+}
+
+void RegexMatcherPrivate::applyCostLimits()
+{
+    mRejected = false;
+    mNoSom = mRequestedNoSom;
+    mBlockDB.reset();
+    mStreamDB.reset();
+    mRecoverDB.reset();
+    mRecoverIds.clear();
+
+    const bool limited = mCostLimits.maxDatabaseSize > 0 || mCostLimits.maxStreamStateSize > 0 || mCostLimits.maxCompileTimeMs > 0;
+    C_RETURN_IF_OK(!limited || mRegxStrings.isEmpty());
+
+    // 块模式与流模式数据库都在这里编译并检查, 之后扫描时直接使用, 结论在下次修改设置前不再变化;
+    // hyperscan 编译不了的规则集走 QRegExp, 不受上限约束
+    auto withinLimits = [this] () -> bool {
+        if (compileHyperScan(HS_MODE_BLOCK) && !checkCostLimits(mBlockDB)) {
             return false;
         }
+        if (compileHyperScan(HS_MODE_STREAM) && !checkCostLimits(mStreamDB)) {
+            return false;
+        }
+        return true;
+    };
+
+    C_RETURN_IF_OK(withinLimits());
+
+    mBlockDB.reset();
+    mStreamDB.reset();
+    if (!mNoSom && mCostLimits.fallbackNoSom) {
+        qWarning() << "HS regex exceeds cost limits, retry without SOM: " << mRegxStrings.join("{]");
+        mNoSom = true;
+        C_RETURN_IF_OK(withinLimits());
+        mBlockDB.reset();
+        mStreamDB.reset();
+    }
+
+    qWarning() << "HS regex exceeds cost limits, rejected: " << mRegxStrings.join("{]");
+    mRejected = true;
+}
 
-        delete regStr;
-        delete regIds;
-        delete regFlags;
+bool RegexMatcherPrivate::checkCostLimits(const HsDatabase& db) const
+{
+    if (mCostLimits.maxDatabaseSize > 0 && static_cast<qint64>(db.databaseSize()) > mCostLimits.maxDatabaseSize) {
+        qWarning() << "HS database size: " << db.databaseSize() << " > " << mCostLimits.maxDatabaseSize;
+        return false;
     }
 
-    if (HS_SUCCESS != hs_alloc_scratch(mHsDB, &mScratch)) {
-        qWarning() << "Error allocating HS scratch";
-        C_FREE_FUNC(mHsDB, hs_free_database);
+    if (mCostLimits.maxStreamStateSize > 0 && static_cast<qint64>(db.streamStateSize()) > mCostLimits.maxStreamStateSize) {
+        qWarning() << "HS stream state size: " << db.streamStateSize() << " > " << mCostLimits.maxStreamStateSize;
+        return false;
+    }
+
+    if (mCostLimits.maxCompileTimeMs > 0 && db.compileTimeMs() > mCostLimits.maxCompileTimeMs) {
+        qWarning() << "HS compile time: " << db.compileTimeMs() << "ms > " << mCostLimits.maxCompileTimeMs << "ms";
         return false;
     }
 
@@ -133,6 +288,230 @@ void RegexMatcherPrivate::addMatchPos(quint64 start, quint64 end)
     mMatchRes.insert(static_cast<qint64>(start), static_cast<qint64>(end));
 }
 
+void RegexMatcherPrivate::addMatchEnd(quint64 end, unsigned int id)
+{
+    // 起始位置未知, 先以结束位置占位
+    const qint64 e = static_cast<qint64>(end);
+    mMatchRes.insert(e, e);
+    if (!mMatchIds.contains(e, id)) {
+        mMatchIds.insert(e, id);
+    }
+    mStartsResolved = false;
+}
+
+void RegexMatcherPrivate::clearMatchResult()
+{
+    mMatchRes.clear();
+    mMatchIds.clear();
+    mCachedContexts.clear();
+    mLineInfo.clear();
+    mStartsResolved = true;
+}
+
+void RegexMatcherPrivate::resolveMatchStarts()
+{
+    C_RETURN_IF_OK(mStartsResolved);
+
+    mStartsResolved = true;
+
+    C_RETURN_IF_OK(mMatchIds.isEmpty());
+
+    // 回溯用不带 SOM 的块模式数据库; 带上下文的数据库编译失败时退回把窗口内的位置当作数据开头
+    if (!compileHyperScan(HS_MODE_BLOCK)) {
+        qWarning() << "Error recovering match start, keep end offsets only.";
+        return;
+    }
+    compileRecoverDatabase();
+
+    // 宽度无上限的规则也只在固定窗口内回溯, 每个命中最多十几次小块扫描
+    const qint64 width = qMin(static_cast<qint64>(mMaxWidth), static_cast<qint64>(NO_SOM_RECOVER_WINDOW));
+
+    QFile file(mContext);
+    const bool isFile = QFile::exists(mContext) && file.open(QIODevice::ReadOnly);
+    const QByteArray str = isFile ? QByteArray() : mContext.toUtf8();
+
+    QMap<qint64, qint64> res;
+    for (auto it = mMatchIds.constBegin(); it != mMatchIds.constEnd(); ++it) {
+        const qint64 end = it.key();
+        const qint64 lowest = qMax(static_cast<qint64>(0), end - width);
+        // 多读最多一个 utf-8 字符作为起点前的上下文
+        const qint64 windowStart = qMax(static_cast<qint64>(0), lowest - 4);
+        QByteArray window;
+        if (isFile) {
+            file.seek(windowStart);
+            window = file.read(end - windowStart);
+        }
+        else {
+            window = str.mid(static_cast<int>(windowStart), static_cast<int>(end - windowStart));
+        }
+        res.insert(windowStart + recoverMatchStart(window, lowest - windowStart, it.value()), end);
+    }
+
+    mMatchRes = res;
+}
+
+/**
+ * 在 window 的 [lowest, len] 内查找 id 号规则恰好在 len 处结束的最右起点, 找不到时返回 len.
+ * window 的开头只有在 windowStart 为 0 时才是数据开头, 其余起点都带上前一个字符扫描 mRecoverDB
+ */
+qint64 RegexMatcherPrivate::recoverMatchStart(const QByteArray& window, qint64 lowest, unsigned int id)
+{
+    const qint64 len = window.size();
+    const char* data = window.constData();
+
+    // 起始位置对齐到 utf-8 字符边界
+    auto alignStart = [&] (qint64 pos) -> qint64 {
+        while (pos < len && 0x80 == (static_cast<uchar>(data[pos]) & 0xC0)) { ++pos; }
+        return pos;
+    };
+
+    // 从 pos 起是否有 id 号规则恰好在 len 处结束的匹配
+    auto matchedAtEnd = [&] (qint64 pos) -> bool {
+        // 前一个字符不参与匹配, 只让 ^ \b 等断言看到真实数据, 不会把 pos 误当作数据开头
+        qint64 from = pos;
+        const HsDatabase* db = &mBlockDB;
+        if (pos > 0 && mRecoverDB.isValid()) {
+            for (from = pos - 1; from > 0 && 0x80 == (static_cast<uchar>(data[from]) & 0xC0); --from) {}
+            db = &mRecoverDB;
+        }
+
+        bool found = false;
+        const unsigned long long to = static_cast<unsigned long long>(len - from);
+        auto onMatch = [&found, to, id] (unsigned int i, unsigned long long, unsigned long long e) -> bool {
+            found = found || (e == to && i == id);
+            return !found;
+        };
+        hsScan(*db, data + from, len - from, onMatch);
+        return found;
+    };
+
+    // 窗口左端越靠前越容易包含匹配, 二分查找仍能匹配到结尾的最右起点
+    if (!matchedAtEnd(alignStart(lowest))) {
+        return len;
+    }
+
+    qint64 lo = lowest;
+    qint64 hi = len;
+    while (lo < hi) {
+        const qint64 mid = lo + (hi - lo + 1) / 2;
+        if (matchedAtEnd(alignStart(mid))) {
+            lo = mid;
+        }
+        else {
+            hi = mid - 1;
+        }
+    }
+
+    return alignStart(lo);
+}
+
+void RegexMatcherPrivate::resolveMatchLines(const QByteArray& data)
+{
+    C_RETURN_IF_FAIL(mLineReport);
+
+    QVector<qint64> ends = mMatchRes.values().toVector();
+    std::sort(ends.begin(), ends.end());
+
+    mLineInfo.clear();
+    resolve_lines(data.constData(), 0, data.size(), 0, ends, true, mLineInfo);
+}
+
+void RegexMatcherPrivate::resolveMatchLines(QFile& file)
+{
+    C_RETURN_IF_FAIL(mLineReport && !mMatchRes.isEmpty());
+    C_RETURN_IF_FAIL(file.seek(0));
+
+    LineTracker lines;
+    for (auto it = mMatchRes.constBegin(); it != mMatchRes.constEnd(); ++it) {
+        lines.addMatch(it.value());
+    }
+
+    mLineInfo.clear();
+    while (!file.atEnd()) {
+        const QByteArray buffer = file.read(mBlockSize);
+        if (buffer.isEmpty()) {
+            break;
+        }
+        lines.append(buffer.constData(), buffer.size());
+        lines.resolve(false, mLineInfo);
+    }
+    lines.resolve(true, mLineInfo);
+}
+
+QByteArray RegexMatcherPrivate::ruleSetHash() const
+{
+    QStringList regs = mRegxStrings;
+    regs.sort();
+
+    QCryptographicHash hash(QCryptographicHash::Sha1);
+    for (const auto& reg : regs) {
+        hash.addData(reg.toUtf8());
+        hash.addData("\0", 1);
+    }
+    hash.addData(mCaseSensitive ? "C" : "c", 1);
+    // 只取设置项与 setCostLimits() 时已确定的模式, 扫描过程中不会变化, 查找与保存用的是同一个键
+    hash.addData(mRequestedNoSom ? "R" : "r", 1);
+    hash.addData(mNoSom ? "S" : "s", 1);
+    hash.addData(QString("%1,%2,%3,%4").arg(mCostLimits.maxDatabaseSize).arg(mCostLimits.maxStreamStateSize)
+                 .arg(mCostLimits.maxCompileTimeMs).arg(mCostLimits.fallbackNoSom ? 1 : 0).toUtf8());
+    hash.addData(QByteArray::number(static_cast<int>(mTextFilter)));
+    hash.addData(mLineReport ? "L" : "l", 1);
+
+    return hash.result();
+}
+
+bool RegexMatcherPrivate::lookupScanCache(const QString& filePath)
+{
+    // 被拒绝的规则集不返回缓存结果
+    C_RETURN_VAL_IF_FAIL(mScanCache && !mRejected, false);
+
+    ScanCache::Entry entry;
+    C_RETURN_VAL_IF_FAIL(mScanCache->lookup(filePath, ruleSetHash(), entry), false);
+
+    clearMatchResult();
+    mMatchRes = entry.matches;
+    mCachedContexts = entry.contexts;
+    for (auto it = entry.lines.constBegin(); it != entry.lines.constEnd(); ++it) {
+        LineInfo info;
+        info.line = it.value();
+        info.start = -1;
+        mLineInfo.insert(it.key(), info);
+    }
+
+    return true;
+}
+
+void RegexMatcherPrivate::storeScanCache(const QString& filePath, const ScanCache::FileStat& before)
+{
+    C_RETURN_IF_FAIL(mScanCache);
+
+    resolveMatchStarts();
+
+    ScanCache::Entry entry;
+    entry.matches = mMatchRes;
+    for (auto it = mLineInfo.constBegin(); it != mLineInfo.constEnd(); ++it) {
+        entry.lines.insert(it.key(), it->line);
+    }
+
+    // 与 ResultIterator 取的上下文相同, 但整个文件只打开一次
+    QFile file(filePath);
+    const bool opened = file.open(QIODevice::ReadOnly | QIODevice::Text);
+    for (auto m = mMatchRes.constBegin(); m != mMatchRes.constEnd(); ++m) {
+        QPair<QString, QString> pair("", "");
+        const auto line = mLineInfo.constFind(m.value());
+        if (line != mLineInfo.constEnd() && line_context(line.value(), m.key(), m.value(), pair)) {
+            entry.contexts.insert(m.key(), pair);
+        }
+        else if (opened) {
+            entry.contexts.insert(m.key(), file_context(file, m.key(), m.value()));
+        }
+    }
+
+    if (mScanCache->store(filePath, ruleSetHash(), entry, before)) {
+        mCachedContexts = entry.contexts;
+    }
+}
+
 bool RegexMatcherPrivate::alreadyMatched() const
 {
     return mMatchRes.count() > 0;
@@ -140,9 +519,20 @@ bool RegexMatcherPrivate::alreadyMatched() const
 
 bool RegexMatcherPrivate::matchHyperScan(const QString& lineBuf)
 {
-    mMatchRes.clear();
+    clearMatchResult();
+
+    auto onMatch = [this] (unsigned int id, unsigned long long from, unsigned long long to) -> bool {
+        if (mNoSom) {
+            addMatchEnd(to, id);
+        }
+        else {
+            addMatchPos(from, to);
+        }
+        return true;
+    };
 
-    if (HS_SUCCESS != hs_scan(mHsDB, lineBuf.toUtf8().constData(), lineBuf.toUtf8().count(), 0, mScratch, hyper_scan_match_cb, this)) {
+    const QByteArray buf = lineBuf.toUtf8();
+    if (!hsScan(mBlockDB, buf.constData(), buf.size(), onMatch)) {
         qWarning() << "Error matching HS regex.";
         return false;
     }
@@ -152,34 +542,240 @@ bool RegexMatcherPrivate::matchHyperScan(const QString& lineBuf)
 
 bool RegexMatcherPrivate::matchHyperScan(QFile& file)
 {
-#define FREE_STREAM(stream) if (stream) { hs_close_stream(stream, mScratch, hyper_scan_match_cb, NULL); stream = nullptr; }
-    mMatchRes.clear();
-    hs_stream* stream = nullptr;
+    clearMatchResult();
 
-    if (HS_SUCCESS != hs_open_stream(mHsDB, 0, &stream)) {
+    LineTracker lines;
+    qint64 base = 0;                                    // 流内偏移 0 对应的文件偏移
+    auto onMatch = [this, &base, &lines] (unsigned int id, unsigned long long from, unsigned long long to) -> bool {
+        if (mNoSom) {
+            addMatchEnd(base + to, id);
+        }
+        else {
+            addMatchPos(base + from, base + to);
+        }
+        if (mLineReport) {
+            lines.addMatch(base + to);
+        }
+        return true;
+    };
+
+    HsScanner<decltype(onMatch)> scanner(mStreamDB, mStreamDB.scratch(), onMatch);
+    if (!scanner.openStream()) {
         qWarning() << "Error opening HS regex stream";
         return false;
     }
 
+    qint64 readPos = 0;
+    qint64 streamPos = 0;                               // 流中下一个字节对应的文件偏移
+    std::vector<TextRange> ranges;
     while (!file.atEnd()) {
-        QByteArray buffer = file.read(mBlockSize);
-        if (HS_SUCCESS != hs_scan_stream(stream, buffer.data(), buffer.size(), 0, mScratch, hyper_scan_match_cb, this)) {
-            qWarning() << "Error matching HS regex stream";
-            FREE_STREAM(stream)
-            return false;
+        const QByteArray buffer = file.read(mBlockSize);
+        if (mLineReport) {
+            lines.append(buffer.constData(), buffer.size());
+        }
+        textFilterRanges(buffer.constData(), buffer.size(), mTextFilter, ranges);
+        for (const auto& r : ranges) {
+            const qint64 start = readPos + static_cast<qint64>(r.start);
+            if (start != streamPos) {
+                // 跳过的区间不能接在流里, 否则会产生跨越空洞的匹配
+                if (!scanner.resetStream()) {
+                    qWarning() << "Error resetting HS regex stream";
+                    return false;
+                }
+                base = start;
+            }
+            if (!scanner.scanStream(buffer.constData() + r.start, r.end - r.start)) {
+                qWarning() << "Error matching HS regex stream";
+                return false;
+            }
+            streamPos = readPos + static_cast<qint64>(r.end);
+        }
+        readPos += buffer.size();
+        if (mLineReport) {
+            lines.resolve(false, mLineInfo);
         }
     }
 
-    FREE_STREAM(stream);
+    C_RETURN_VAL_IF_FAIL(scanner.closeStream(), false);
+
+    if (mLineReport) {
+        lines.resolve(true, mLineInfo);
+    }
+
+    return true;
+}
+
+bool RegexMatcherPrivate::matchHyperScanParallel(QFile& file)
+{
+    C_RETURN_VAL_IF_FAIL(mParallelMinSize > 0 && file.size() >= mParallelMinSize, false);
+    C_RETURN_VAL_IF_FAIL(QFile::exists(file.fileName()), false);
+    C_RETURN_VAL_IF_FAIL(compileHyperScan(HS_MODE_BLOCK), false);
+
+    // 匹配宽度无上限或超过块大小时无法靠重叠保证不漏匹配, 交给流模式
+    const qint64 overlap = mMaxWidth;
+    C_RETURN_VAL_IF_FAIL(mMaxWidth != UINT_MAX && overlap < PARALLEL_CHUNK_SIZE / 2, false);
+
+    clearMatchResult();
+
+    const QString fileName = file.fileName();
+    const qint64 fileSize = file.size();
+    const qint64 chunkNum = (fileSize + PARALLEL_CHUNK_SIZE - 1) / PARALLEL_CHUNK_SIZE;
+    const int threadNum = static_cast<int>(qBound(static_cast<qint64>(1), static_cast<qint64>(mParallelThreads > 0 ? mParallelThreads : QThread::idealThreadCount()), chunkNum));
+    const bool noSom = mNoSom;
+    const TextFilterMode textFilter = mTextFilter;
+    const bool lineReport = mLineReport;
+
+    std::mutex lock;
+    std::atomic<qint64> nextChunk(0);
+    std::atomic<bool> failed(false);
+    QVector<ChunkMatch> matches;
+
+    // 每块换行数及块内相对行号, 全部完成后按前缀和换算成绝对行号
+    std::vector<qint64> chunkNewlines(chunkNum, 0);
+    std::vector<QMap<qint64, LineInfo>> chunkLines(chunkNum);
+
+    auto worker = [&] () {
+        HsScratch scratch(mBlockDB);
+        QFile f(fileName);
+        if (!scratch.isValid() || !f.open(QIODevice::ReadOnly)) {
+            failed = true;
+            return;
+        }
+
+        QVector<ChunkMatch> local;
+        qint64 base = 0;
+        qint64 ownedLow = 0;
+        qint64 ownedHigh = 0;
+        auto onMatch = [&local, &base, &ownedLow, &ownedHigh, noSom] (unsigned int id, unsigned long long from, unsigned long long to) -> bool {
+            // 结束位置落在 (块起点 + 重叠, 块终点 + 重叠] 的匹配归本块, 起点一定完整落在本块内, 不会重复
+            const qint64 end = base + static_cast<qint64>(to);
+            if (end > ownedLow && end <= ownedHigh) {
+                const ChunkMatch m = { noSom ? end : base + static_cast<qint64>(from), end, id };
+                local.append(m);
+            }
+            return true;
+        };
+        HsScanner<decltype(onMatch)> scanner(mBlockDB, scratch.get(), onMatch);
+
+        std::vector<TextRange> ranges;
+        for (qint64 idx = nextChunk++; idx < chunkNum && !failed; idx = nextChunk++) {
+            const qint64 chunkStart = idx * PARALLEL_CHUNK_SIZE;
+            ownedLow = (0 == idx) ? -1 : chunkStart + overlap;
+            ownedHigh = chunkStart + PARALLEL_CHUNK_SIZE + overlap;
+            // 末端对齐到过滤小块边界, 使相邻块对重叠区的文本/二进制判断一致; 行上下文需要前后多取一些.
+            // 末端至少越过 ownedHigh 一个完整 utf-8 字符, 否则 ownedHigh 处会被当作数据结尾, 误报 $ \b 等断言
+            const qint64 pre = lineReport ? qMin(chunkStart, static_cast<qint64>(LINE_CONTEXT_MAX)) : 0;
+            const qint64 post = lineReport ? LINE_CONTEXT_MAX : 0;
+            const qint64 mapEnd = (ownedHigh + 4 + TEXT_FILTER_BLOCK_SIZE - 1) / TEXT_FILTER_BLOCK_SIZE * TEXT_FILTER_BLOCK_SIZE;
+            const qint64 len = qMin(fileSize, mapEnd) - chunkStart;
+            const qint64 mapLen = pre + qMin(fileSize, mapEnd + post) - chunkStart;
+            const int chunkFirst = local.size();
+
+            auto scanChunk = [&] (const char* mapped) -> bool {
+                const char* data = mapped + pre;
+                textFilterRanges(data, len, textFilter, ranges);
+                for (const auto& r : ranges) {
+                    base = chunkStart + static_cast<qint64>(r.start);
+                    if (!scanner.scan(data + r.start, r.end - r.start)) {
+                        return false;
+                    }
+                }
+
+                if (lineReport) {
+                    QVector<qint64> ends;
+                    for (int i = chunkFirst; i < local.size(); ++i) {
+                        ends.append(local[i].end);
+                    }
+                    std::sort(ends.begin(), ends.end());
+                    chunkNewlines[idx] = textFilterCountNewlines(data, qMin(static_cast<qint64>(PARALLEL_CHUNK_SIZE), fileSize - chunkStart));
+                    resolve_lines(mapped, chunkStart - pre, mapLen, -static_cast<qint64>(textFilterCountNewlines(mapped, pre)), ends, true, chunkLines[idx]);
+                }
+                return true;
+            };
+
+            bool ok = false;
+            uchar* mem = f.map(chunkStart - pre, mapLen);
+            if (mem) {
+                ok = scanChunk(reinterpret_cast<const char*>(mem));
+                f.unmap(mem);
+            }
+            else if (f.seek(chunkStart - pre)) {
+                const QByteArray buffer = f.read(mapLen);
+                ok = (buffer.size() == mapLen) && scanChunk(buffer.constData());
+            }
+
+            if (!ok) {
+                failed = true;
+            }
+        }
+
+        std::lock_guard<std::mutex> guard(lock);
+        matches += local;
+    };
+
+    std::vector<std::thread> threads;
+    for (int i = 0; i < threadNum; ++i) {
+        threads.emplace_back(worker);
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+
+    if (failed) {
+        qWarning() << "Error matching HS regex in parallel, file: " << fileName;
+        clearMatchResult();
+        return false;
+    }
+
+    for (const auto& m : matches) {
+        if (noSom) {
+            addMatchEnd(m.end, m.id);
+        }
+        else {
+            addMatchPos(m.start, m.end);
+        }
+    }
+
+    qint64 linesBefore = 0;
+    for (qint64 idx = 0; lineReport && idx < chunkNum; ++idx) {
+        for (auto it = chunkLines[idx].begin(); it != chunkLines[idx].end(); ++it) {
+            it->line += linesBefore;
+            mLineInfo.insert(it.key(), it.value());
+        }
+        linesBefore += chunkNewlines[idx];
+    }
+
+    return true;
+}
+
+bool RegexMatcherPrivate::matchHyperScan(const QByteArray& records, const QVector<qint64>& offsets, QVector<RegexMatcher::BatchMatch>& results)
+{
+    qint64 recordIndex = 0;
+    const bool noSom = mNoSom;
+    auto onMatch = [&results, &recordIndex, noSom] (unsigned int id, unsigned long long from, unsigned long long to) -> bool {
+        const RegexMatcher::BatchMatch m = { recordIndex, noSom ? -1 : static_cast<qint64>(from), static_cast<qint64>(to), id };
+        results.append(m);
+        return true;
+    };
+
+    HsScanner<decltype(onMatch)> scanner(mBlockDB, mBlockDB.scratch(), onMatch);
+    const char* data = records.constData();
+    for (int i = 0; i + 1 < offsets.count(); ++i) {
+        recordIndex = i;
+        if (!scanner.scan(data + offsets[i], offsets[i + 1] - offsets[i])) {
+            qWarning() << "Error matching HS regex, record: " << i;
+            return false;
+        }
+    }
 
     return true;
 }
 
 bool RegexMatcherPrivate::matchRegexp(QFile& file)
 {
-    C_RETURN_VAL_IF_OK(mRegxStrings.isEmpty(), false);
+    C_RETURN_VAL_IF_OK(mRegxStrings.isEmpty() || mRejected, false);
 
-    mMatchRes.clear();
+    clearMatchResult();
 
     const qint64 step2 = mBlockSize / 6 * 4;
 
@@ -225,9 +821,9 @@ bool RegexMatcherPrivate::matchRegexp(QFile& file)
 
 bool RegexMatcherPrivate::matchRegexp(const QString& lineBuf)
 {
-    C_RETURN_VAL_IF_OK(mRegxStrings.isEmpty(), false);
+    C_RETURN_VAL_IF_OK(mRegxStrings.isEmpty() || mRejected, false);
 
-    mMatchRes.clear();
+    clearMatchResult();
 
     if (1 == mRegxStrings.count()) {
         const QRegExp regExp(*mRegxStrings.constBegin(), mCaseSensitive ? Qt::CaseSensitive : Qt::CaseInsensitive);
@@ -278,7 +874,17 @@ QPair<QString, QString> RegexMatcher::ResultIterator::next()
     if (mCurrent != mEnd) {
         const qint64 s = mCurrent.key();
         const qint64 e = mCurrent.value();
-        if (!QFile::exists(mRI.d_ptr->mContext)) {
+        const auto cached = mRI.d_ptr->mCachedContexts.constFind(s);
+        const auto line = mRI.d_ptr->mLineInfo.constFind(e);
+        const bool hasLine = (line != mRI.d_ptr->mLineInfo.constEnd());
+        mLine = hasLine ? line->line : -1;
+        if (cached != mRI.d_ptr->mCachedContexts.constEnd()) {
+            pair = cached.value();
+        }
+        else if (hasLine && line_context(line.value(), s, e, pair)) {
+            // 扫描时已记录整行, 不需要再读文件
+        }
+        else if (!QFile::exists(mRI.d_ptr->mContext)) {
             qint64 s1 = s - 24;
             qint64 e1 = e + 24;
 
@@ -294,22 +900,9 @@ QPair<QString, QString> RegexMatcher::ResultIterator::next()
         }
         else {
             QFile file(mRI.d_ptr->mContext);
-
-            qint64 s1 = s - 24;
-            qint64 e1 = e + 24;
-
             if (file.open(QIODevice::ReadOnly | QIODevice::Text)) {
-                const qint64 fileSize = file.size();
-                if (s1 < 0) { s1 = 0; }
-                if (e1 > fileSize) { e1 = fileSize; }
-
-                file.seek(s1);
-                const QString ctxT = file.read(e1 - s1);
-                file.seek(s);
-                const QString key = file.read(e - s);
+                pair = file_context(file, s, e);
                 file.close();
-                const QString ctx = validUtf8String(ctxT.toUtf8().constData(), ctxT.toUtf8().size());
-                pair = QPair<QString, QString>(key, ctx);
             }
         }
         ++mCurrent;
@@ -318,8 +911,15 @@ QPair<QString, QString> RegexMatcher::ResultIterator::next()
     return pair;
 }
 
+qint64 RegexMatcher::ResultIterator::line() const
+{
+    return mLine;
+}
+
 void RegexMatcher::ResultIterator::reset()
 {
+    mRI.d_ptr->resolveMatchStarts();
+    mLine = -1;
     mCurrent = mRI.d_ptr->mMatchRes.constBegin();
     mEnd = mRI.d_ptr->mMatchRes.constEnd();
 }
@@ -332,6 +932,26 @@ RegexMatcher::RegexMatcher(const QString& reg, bool caseSensitive, qint64 blockS
     d->mCaseSensitive = caseSensitive;
     if (!reg.isEmpty()) {
         d->mRegxStrings += reg;
+        d->mRegxIds.push_back(0);
+    }
+}
+
+RegexMatcher::RegexMatcher(const QStringList& regs, bool caseSensitive, qint64 blockSize, QObject* parent)
+    : QObject(parent), d_ptr(new RegexMatcherPrivate(this, blockSize))
+{
+    Q_D(RegexMatcher);
+
+    d->mCaseSensitive = caseSensitive;
+    // 去掉空规则与重复规则, id 仍按调用者列表中的位置, 重复的规则只报第一次出现的 id
+    QSet<QString> seen;
+    seen.reserve(regs.count());
+    for (int i = 0; i < regs.count(); ++i) {
+        const QString& reg = regs[i];
+        if (!reg.isEmpty() && !seen.contains(reg)) {
+            seen.insert(reg);
+            d->mRegxStrings += reg;
+            d->mRegxIds.push_back(static_cast<unsigned int>(i + 1));
+        }
     }
 }
 
@@ -346,14 +966,29 @@ bool RegexMatcher::match(QFile& file)
 
     d->mContext = file.fileName();
 
+    C_RETURN_VAL_IF_OK(d->mRejected, false);
+
+    if (d->lookupScanCache(file.fileName())) {
+        return true;
+    }
+
+    // 缓存键取自读文件之前的状态
+    ScanCache::FileStat before = {};
+    const bool cacheable = d->mScanCache && ScanCache::fileStat(file.fileName(), before);
+
     bool ret = false;
 
+    // 过滤二进制内容时需要原始字节, 不走整体转成字符串的路径
     const quint64 fileSize = file.size();
-    if (fileSize <= d->mBlockSize) {
+    if (fileSize <= d->mBlockSize && TEXT_FILTER_NONE == d->mTextFilter) {
         const QByteArray all = file.readAll();
         ret = match(all);
     }
 
+    if (!ret) {
+        ret = d->matchHyperScanParallel(file);
+    }
+
     if (!ret) {
         if (d->compileHyperScan(HS_MODE_STREAM)) {
             if (d->matchHyperScan(file)) {
@@ -363,6 +998,14 @@ bool RegexMatcher::match(QFile& file)
     }
     if (!ret) {
         ret = d->matchRegexp(file);
+        if (ret) {
+            // QRegExp 分块回退匹配不跟踪行, 另外顺序读一遍文件计算行号
+            d->resolveMatchLines(file);
+        }
+    }
+
+    if (ret && cacheable) {
+        d->storeScanCache(file.fileName(), before);
     }
 
     return ret;
@@ -372,9 +1015,117 @@ QMap<qint64, qint64> RegexMatcher::getMatchResults()
 {
     Q_D(RegexMatcher);
 
+    d->resolveMatchStarts();
+
     return d->mMatchRes;
 }
 
+QList<qint64> RegexMatcher::getMatchEnds()
+{
+    Q_D(RegexMatcher);
+
+    return d->mMatchRes.values();
+}
+
+void RegexMatcher::setCompileShards(int shards)
+{
+    Q_D(RegexMatcher);
+
+    C_RETURN_IF_OK(d->mCompileShards == shards);
+
+    d->mCompileShards = shards;
+    d->applyCostLimits();
+}
+
+void RegexMatcher::setParallelScan(qint64 minFileSize, int threads)
+{
+    Q_D(RegexMatcher);
+
+    d->mParallelMinSize = minFileSize;
+    d->mParallelThreads = threads;
+}
+
+QList<RegexMatcher::PatternCost> RegexMatcher::analyzePatterns(const QStringList& patterns, bool caseSensitive, bool som)
+{
+    QList<PatternCost> costs;
+
+    unsigned int flags = HS_FLAG_ALLOWEMPTY | HS_FLAG_UTF8 | HS_FLAG_UCP | HS_FLAG_MULTILINE;
+    if (!caseSensitive) {
+        flags |= HS_FLAG_CASELESS;
+    }
+
+    for (const auto& pattern : patterns) {
+        const HsPatternCost c = hsAnalyzePattern(pattern.toUtf8().toStdString(), flags, som);
+        PatternCost cost;
+        cost.pattern = pattern;
+        cost.valid = c.valid;
+        cost.error = QString::fromStdString(c.error);
+        cost.minWidth = c.minWidth;
+        cost.maxWidth = c.maxWidth;
+        cost.needSom = c.needSom;
+        cost.blockDatabaseSize = static_cast<qint64>(c.blockDatabaseSize);
+        cost.streamDatabaseSize = static_cast<qint64>(c.streamDatabaseSize);
+        cost.streamStateSize = static_cast<qint64>(c.streamStateSize);
+        cost.compileTimeMs = c.compileTimeMs;
+        costs.append(cost);
+    }
+
+    return costs;
+}
+
+void RegexMatcher::setCostLimits(const CostLimits& limits)
+{
+    Q_D(RegexMatcher);
+
+    d->mCostLimits = limits;
+    d->applyCostLimits();
+}
+
+bool RegexMatcher::isRejected() const
+{
+    Q_D(const RegexMatcher);
+
+    return d->mRejected;
+}
+
+void RegexMatcher::setLineReport(bool enable)
+{
+    Q_D(RegexMatcher);
+
+    d->mLineReport = enable;
+}
+
+void RegexMatcher::setTextFilter(TextFilterMode mode)
+{
+    Q_D(RegexMatcher);
+
+    d->mTextFilter = mode;
+}
+
+void RegexMatcher::setScanCache(ScanCache* cache)
+{
+    Q_D(RegexMatcher);
+
+    d->mScanCache = cache;
+}
+
+QByteArray RegexMatcher::ruleSetHash() const
+{
+    Q_D(const RegexMatcher);
+
+    return d->ruleSetHash();
+}
+
+void RegexMatcher::setNoSomMode(bool noSom)
+{
+    Q_D(RegexMatcher);
+
+    C_RETURN_IF_OK(d->mRequestedNoSom == noSom);
+
+    d->mRequestedNoSom = noSom;
+    d->applyCostLimits();
+}
+
 RegexMatcher::ResultIterator RegexMatcher::getResultIterator() const
 {
     return ResultIterator(*this);
@@ -393,25 +1144,164 @@ bool RegexMatcher::match(const QString& str)
 
     d->mContext = str;
 
+    const bool ret = d->compileHyperScan() ? d->matchHyperScan(str) : d->matchRegexp(str);
+    if (ret) {
+        d->resolveMatchLines(str.toUtf8());
+    }
+
+    return ret;
+}
+
+bool RegexMatcher::matchBatch(const QByteArray& records, const QVector<qint64>& offsets, QVector<BatchMatch>& results)
+{
+    Q_D(RegexMatcher);
+
+    results.clear();
+
+    C_RETURN_VAL_IF_FAIL(!offsets.isEmpty() && offsets.first() >= 0 && offsets.last() <= records.size(), false);
+    for (int i = 0; i + 1 < offsets.count(); ++i) {
+        C_RETURN_VAL_IF_FAIL(offsets[i] <= offsets[i + 1], false);
+    }
+
     if (d->compileHyperScan()) {
-        return d->matchHyperScan(str);
+        return d->matchHyperScan(records, offsets, results);
+    }
+
+    // hyperscan 不支持时逐条回退到 QRegExp, 结果直接写入 results, 不动 getMatchResults() 的结果, id 与 hyperscan 一致
+    C_RETURN_VAL_IF_OK(d->mRegxStrings.isEmpty() || d->mRejected, false);
+
+    QVector<QRegExp> regExps;
+    for (const auto& reg : d->mRegxStrings) {
+        regExps.append(QRegExp(reg, d->mCaseSensitive ? Qt::CaseSensitive : Qt::CaseInsensitive));
     }
 
-    return d->matchRegexp(str);
+    for (int i = 0; i + 1 < offsets.count(); ++i) {
+        const QByteArray record = QByteArray::fromRawData(records.constData() + offsets[i], static_cast<int>(offsets[i + 1] - offsets[i]));
+        const QString str = QString::fromUtf8(record);
+        for (int r = 0; r < regExps.count(); ++r) {
+            const unsigned int id = d->mRegxIds[r];
+            int pos = 0;
+            while (-1 != (pos = regExps[r].indexIn(str, pos))) {
+                const int len = regExps[r].matchedLength();
+                const qint64 start = str.left(pos).toUtf8().size();
+                const BatchMatch m = { i, start, start + str.mid(pos, len).toUtf8().size(), id };
+                results.append(m);
+                pos += qMax(len, 1);
+            }
+        }
+    }
+
+    return true;
+}
+
+void LineTracker::append(const char* data, qint64 len)
+{
+    mWindow.append(data, static_cast<int>(len));
 }
 
+void LineTracker::addMatch(qint64 end)
+{
+    mPending.append(end);
+}
 
-static int hyper_scan_match_cb (unsigned int id, unsigned long long from, unsigned long long to, unsigned int flags, void* ctx)
+void LineTracker::resolve(bool eof, QMap<qint64, LineInfo>& out)
 {
-    if (!ctx) {
-        return HS_SUCCESS;
+    std::sort(mPending.begin(), mPending.end());
+
+    const int done = resolve_lines(mWindow.constData(), mWinStart, mWindow.size(), mLinesBefore, mPending, eof, out);
+    mPending.remove(0, done);
+
+    // 只保留未处理匹配及下一段数据行首需要的部分
+    qint64 keep = mWinStart + mWindow.size() - LINE_CONTEXT_MAX;
+    if (!mPending.isEmpty()) {
+        keep = qMin(keep, mPending.first() - 1 - LINE_CONTEXT_MAX);
+    }
+
+    if (keep > mWinStart) {
+        const int drop = static_cast<int>(keep - mWinStart);
+        mLinesBefore += static_cast<qint64>(textFilterCountNewlines(mWindow.constData(), drop));
+        mWindow.remove(0, drop);
+        mWinStart = keep;
     }
+}
+
+/**
+ * data 为原数据 [dataStart, dataStart + len) 部分, linesBefore 为 dataStart 之前的换行数;
+ * 按升序依次计算 ends 中每个匹配最后一个字节所在的行, 行尾不在 data 中且 eof 为 false 时停止,
+ * 返回已处理的个数
+ */
+static int resolve_lines(const char* data, qint64 dataStart, qint64 len, qint64 linesBefore, const QVector<qint64>& ends, bool eof, QMap<qint64, LineInfo>& out)
+{
+    const qint64 dataEnd = dataStart + len;
+
+    qint64 cursor = dataStart;
+    qint64 lines = linesBefore;
+
+    int done = 0;
+    for (; done < ends.size(); ++done) {
+        const qint64 end = ends[done];
+        const qint64 pos = qBound(dataStart, end > 0 ? end - 1 : 0, dataEnd);
+
+        // 行尾
+        const qint64 limit = qMin(dataEnd, pos + LINE_CONTEXT_MAX);
+        const char* nl = (pos < limit) ? static_cast<const char*>(memchr(data + (pos - dataStart), '\n', limit - pos)) : nullptr;
+        if (!nl && limit == dataEnd && !eof) {
+            break;
+        }
+        const qint64 lineEnd = nl ? dataStart + (nl - data) : limit;
+
+        // 行首
+        const qint64 floor = qMax(dataStart, pos - LINE_CONTEXT_MAX);
+        qint64 lineStart = pos;
+        while (lineStart > floor && '\n' != data[lineStart - 1 - dataStart]) {
+            --lineStart;
+        }
+
+        lines += static_cast<qint64>(textFilterCountNewlines(data + (cursor - dataStart), pos - cursor));
+        cursor = pos;
+
+        LineInfo info;
+        info.line = lines + 1;
+        info.start = lineStart;
+        info.text = QByteArray(data + (lineStart - dataStart), static_cast<int>(lineEnd - lineStart));
+        out.insert(end, info);
+    }
+
+    return done;
+}
+
+/**
+ * 匹配 [s, e) 完整落在扫描时记录的行内时, 关键字取自该行, 上下文为整行
+ */
+static bool line_context(const LineInfo& line, qint64 s, qint64 e, QPair<QString, QString>& pair)
+{
+    C_RETURN_VAL_IF_FAIL(s >= line.start && e <= line.start + line.text.size(), false);
+
+    const QString key = line.text.mid(static_cast<int>(s - line.start), static_cast<int>(e - s));
+    pair = QPair<QString, QString>(key, validUtf8String(line.text.constData(), line.text.size()));
+
+    return true;
+}
+
+/**
+ * 从已打开的文件读取匹配 [s, e) 及前后各 24 字节的上下文
+ */
+static QPair<QString, QString> file_context(QFile& file, qint64 s, qint64 e)
+{
+    qint64 s1 = s - 24;
+    qint64 e1 = e + 24;
 
-    static_cast<RegexMatcherPrivate*>(ctx)->addMatchPos(from, to);
+    const qint64 fileSize = file.size();
+    if (s1 < 0) { s1 = 0; }
+    if (e1 > fileSize) { e1 = fileSize; }
 
-    Q_UNUSED(flags);
+    file.seek(s1);
+    const QString ctxT = file.read(e1 - s1);
+    file.seek(s);
+    const QString key = file.read(e - s);
+    const QString ctx = validUtf8String(ctxT.toUtf8().constData(), ctxT.toUtf8().size());
 
-    return HS_SUCCESS;
+    return QPair<QString, QString>(key, ctx);
 }
 
 static QString chineseSimpleToTradition(const QString& str)
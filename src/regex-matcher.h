@@ -5,10 +5,15 @@
 #ifndef hs_wrap_SCANNER_H
 #define hs_wrap_SCANNER_H
 #include <qmap.h>
+#include <qvector.h>
+#include <qstringlist.h>
 #include <QObject>
 
+#include "text-filter.h"
+
 
 class QFile;
+class ScanCache;
 class RegexMatcherPrivate;
 class RegexMatcherResultIterator;
 class RegexMatcher final : public QObject
@@ -26,23 +31,97 @@ public:
         bool hasNext() const;
         // keyword, context
         QPair<QString, QString> next();
+        // 上一次 next() 返回的匹配所在行号(从 1 开始), 未开启行号记录时为 -1
+        qint64 line() const;
         void reset();
 
     private:
         const RegexMatcher&             mRI;
         ResultConstIterator             mEnd;
         ResultConstIterator             mCurrent;
+        qint64                          mLine = -1;
+    };
+
+    struct BatchMatch
+    {
+        qint64          recordIndex;        // 记录下标
+        qint64          start;              // 相对记录起始位置的偏移, 不带 SOM 模式下为 -1
+        qint64          end;
+        unsigned int    id;                 // 规则 id, 单条规则构造时为 0
+    };
+
+    // 规则代价评估结果
+    struct PatternCost
+    {
+        QString         pattern;
+        bool            valid;              // hyperscan 能否编译
+        QString         error;
+        quint32         minWidth;           // 字节
+        quint32         maxWidth;           // 0xFFFFFFFF 表示无上限
+        bool            needSom;            // 需要起始位置且规则变长
+        qint64          blockDatabaseSize;
+        qint64          streamDatabaseSize;
+        qint64          streamStateSize;    // 每个流的状态大小
+        double          compileTimeMs;
+    };
+
+    // 规则集资源上限, 0 表示不限制; 超出时若 fallbackNoSom 为 true 先改用不带 SOM 的模式重新编译, 仍超出则拒绝该规则集
+    struct CostLimits
+    {
+        qint64          maxDatabaseSize = 0;
+        qint64          maxStreamStateSize = 0;
+        double          maxCompileTimeMs = 0;
+        bool            fallbackNoSom = true;
     };
 
     explicit RegexMatcher(const QString& reg, bool caseSensitive=true, qint64 blockSize=(2<<20), QObject *parent = nullptr);
+    // 多条规则合成一个匹配器, 规则 id 为规则在 regs 中的下标 + 1(空规则与重复规则跳过, 不影响其他规则的 id)
+    explicit RegexMatcher(const QStringList& regs, bool caseSensitive=true, qint64 blockSize=(2<<20), QObject *parent = nullptr);
     ~RegexMatcher() override;
 
     qint64 getMatchedCount();
 
+    // 接受规则前逐条评估代价, 不影响当前对象
+    static QList<PatternCost> analyzePatterns(const QStringList& patterns, bool caseSensitive=true, bool som=true);
+
+    // 设置时立即编译块模式与流模式数据库并检查代价, 是否去掉 SOM/是否拒绝在此一次决定, 之后扫描不会再改变;
+    // 编译无法中途打断, 编译耗时只能在编译完成后判定. 被拒绝的规则集所有 match 均返回 false
+    void setCostLimits(const CostLimits& limits);
+    bool isRejected() const;
+
+    // 不记录匹配起始位置(去掉 SOM): 编译更快, 流状态更小, 能用 hyperscan 的规则更多;
+    // 扫描只得到结束位置, 起始位置在 getMatchResults()/getResultIterator() 时在结束位置前最多 4K 的窗口内回溯恢复.
+    // 恢复的是同一条规则在该结束位置结束的最短匹配的起点(最右起点), 不是 SOM 模式的最左起点; 回溯时起点前的字符作为上下文, ^ \b 等断言与扫描时一致;
+    // 宽度无上限或超过 4K 的规则, 起点最多只能恢复到结束位置前 4K 处
+    void setNoSomMode(bool noSom);
+
+    // 规则数达到 2000 条以上时最多切成 shards 个分片多线程并行编译(每片至少 1000 条), 扫描结果仍合并为一个.
+    // 每个分片都要单独扫描一遍数据, 扫描耗时随分片数成倍增加; 默认 1 不分片, shards <= 0 使用 CPU 核数
+    void setCompileShards(int shards);
+
+    // 不小于 minFileSize 的文件按块切分后多线程块模式扫描, 相邻块重叠规则最大匹配宽度;
+    // 规则宽度无上限时自动退回流模式. minFileSize <= 0 关闭, threads <= 0 使用 CPU 核数
+    void setParallelScan(qint64 minFileSize, int threads=0);
+
+    // 文件扫描结果缓存(不接管所有权): 文件与规则集均未变化时 match(QFile&) 直接返回缓存结果
+    void setScanCache(ScanCache* cache);
+    // 当前规则集(规则、影响结果的选项与代价上限)的哈希, 即扫描缓存中的规则集目录名, 用于 ScanCache::removeRuleSet()/removeOtherRuleSets()
+    QByteArray ruleSetHash() const;
+
+    // 文件中二进制内容的处理方式: 全部扫描(默认)/跳过二进制块/只扫描二进制块中的可打印片段, 匹配位置仍为原文件偏移
+    void setTextFilter(TextFilterMode mode);
+
+    // 扫描时同时记录每个匹配所在的行号和整行内容, ResultIterator 直接返回整行作为上下文, 不再回读文件
+    void setLineReport(bool enable);
+
     bool match(QFile& file);
     bool match(const QString& str);
+    // 批量匹配: records 中所有记录首尾相接, 第 i 条记录为 [offsets[i], offsets[i + 1])
+    // 结果追加到 results 中(调用前清空, 保留容量), 不修改 getMatchResults() 的结果
+    bool matchBatch(const QByteArray& records, const QVector<qint64>& offsets, QVector<BatchMatch>& results);
 
     QMap<qint64, qint64> getMatchResults();
+    QList<qint64> getMatchEnds();
     ResultIterator getResultIterator() const;
 
 Q_SIGNALS:
@@ -0,0 +1,140 @@
+//
+// Created by dingjing on 10/18/26.
+//
+
+#include "scan-cache.h"
+
+#include <QDir>
+#include <QFile>
+#include <QDebug>
+#include <QFileInfo>
+#include <QSaveFile>
+#include <QDataStream>
+#include <sys/stat.h>
+
+#include "macros/macros.h"
+
+#define SCAN_CACHE_MAGIC        0x48534341      // HSCA
+#define SCAN_CACHE_VERSION      2
+
+
+bool ScanCache::fileStat(const QString& filePath, FileStat& st)
+{
+    struct stat buf = {};
+    C_RETURN_VAL_IF_FAIL(0 == stat(filePath.toUtf8().constData(), &buf), false);
+    C_RETURN_VAL_IF_FAIL(S_ISREG(buf.st_mode), false);
+
+    st.dev = static_cast<quint64>(buf.st_dev);
+    st.ino = static_cast<quint64>(buf.st_ino);
+    st.size = static_cast<qint64>(buf.st_size);
+    st.mtime = static_cast<qint64>(buf.st_mtim.tv_sec) * 1000000000LL + static_cast<qint64>(buf.st_mtim.tv_nsec);
+
+    return true;
+}
+
+ScanCache::ScanCache(const QString& dir)
+    : mDir(dir)
+{
+    mValid = !mDir.isEmpty() && QDir().mkpath(mDir);
+    if (!mValid) {
+        qWarning() << "Error creating scan cache dir: " << mDir;
+    }
+}
+
+bool ScanCache::isValid() const
+{
+    return mValid;
+}
+
+QString ScanCache::getDir() const
+{
+    return mDir;
+}
+
+bool ScanCache::lookup(const QString& filePath, const QByteArray& ruleSetHash, Entry& entry) const
+{
+    C_RETURN_VAL_IF_FAIL(mValid, false);
+
+    FileStat st = {};
+    C_RETURN_VAL_IF_FAIL(fileStat(filePath, st), false);
+
+    QFile file(entryPath(st.dev, st.ino, ruleSetHash));
+    C_RETURN_VAL_IF_FAIL(file.open(QIODevice::ReadOnly), false);
+
+    QDataStream in(&file);
+    in.setVersion(QDataStream::Qt_5_0);
+
+    quint32 magic = 0;
+    quint32 version = 0;
+    qint64 size = -1;
+    qint64 mtime = -1;
+    in >> magic >> version >> size >> mtime;
+    C_RETURN_VAL_IF_FAIL(SCAN_CACHE_MAGIC == magic && SCAN_CACHE_VERSION == version, false);
+    C_RETURN_VAL_IF_FAIL(st.size == size && st.mtime == mtime, false);
+
+    Entry e;
+    in >> e.matches >> e.contexts >> e.lines;
+    C_RETURN_VAL_IF_FAIL(QDataStream::Ok == in.status(), false);
+
+    entry = e;
+
+    return true;
+}
+
+bool ScanCache::store(const QString& filePath, const QByteArray& ruleSetHash, const Entry& entry, const FileStat& before)
+{
+    C_RETURN_VAL_IF_FAIL(mValid, false);
+
+    FileStat st = {};
+    C_RETURN_VAL_IF_FAIL(fileStat(filePath, st), false);
+    C_RETURN_VAL_IF_FAIL(st.dev == before.dev && st.ino == before.ino && st.size == before.size && st.mtime == before.mtime, false);
+
+    const QString path = entryPath(st.dev, st.ino, ruleSetHash);
+    C_RETURN_VAL_IF_FAIL(QDir().mkpath(QFileInfo(path).absolutePath()), false);
+
+    // 先写临时文件再替换, 避免并发读到半个条目
+    QSaveFile file(path);
+    C_RETURN_VAL_IF_FAIL(file.open(QIODevice::WriteOnly), false);
+
+    QDataStream out(&file);
+    out.setVersion(QDataStream::Qt_5_0);
+    out << static_cast<quint32>(SCAN_CACHE_MAGIC) << static_cast<quint32>(SCAN_CACHE_VERSION) << st.size << st.mtime;
+    out << entry.matches << entry.contexts << entry.lines;
+
+    if (QDataStream::Ok != out.status() || !file.commit()) {
+        qWarning() << "Error writing scan cache: " << path;
+        return false;
+    }
+
+    return true;
+}
+
+bool ScanCache::removeRuleSet(const QByteArray& ruleSetHash)
+{
+    C_RETURN_VAL_IF_FAIL(mValid, false);
+
+    QDir dir(mDir + "/" + QString::fromLatin1(ruleSetHash.toHex()));
+
+    return !dir.exists() || dir.removeRecursively();
+}
+
+bool ScanCache::removeOtherRuleSets(const QByteArray& ruleSetHash)
+{
+    C_RETURN_VAL_IF_FAIL(mValid, false);
+
+    bool ret = true;
+    const QString keep = QString::fromLatin1(ruleSetHash.toHex());
+    const QStringList dirs = QDir(mDir).entryList(QDir::Dirs | QDir::NoDotAndDotDot);
+    for (const auto& name : dirs) {
+        if (name != keep && !QDir(mDir + "/" + name).removeRecursively()) {
+            ret = false;
+        }
+    }
+
+    return ret;
+}
+
+QString ScanCache::entryPath(quint64 dev, quint64 ino, const QByteArray& ruleSetHash) const
+{
+    return QString("%1/%2/%3-%4").arg(mDir, QString::fromLatin1(ruleSetHash.toHex())).arg(dev).arg(ino);
+}
@@ -0,0 +1,65 @@
+//
+// Created by dingjing on 10/18/26.
+//
+
+#ifndef hs_wrap_SCAN_CACHE_H
+#define hs_wrap_SCAN_CACHE_H
+#include <qmap.h>
+#include <qpair.h>
+#include <QString>
+#include <QByteArray>
+
+
+/**
+ * 扫描结果持久化缓存
+ *  以 (设备号, inode, 文件大小, 修改时间, 规则集哈希) 为键保存文件的匹配结果与上下文,
+ *  文件未变化时直接返回缓存结果, 无需重新读取文件.
+ *
+ * 目录结构: <dir>/<规则集哈希>/<设备号>-<inode>
+ *  规则集变化只会让该规则集下的条目失效, 其它规则集的条目不受影响.
+ */
+class ScanCache final
+{
+public:
+    struct Entry
+    {
+        QMap<qint64, qint64>                    matches;        // 起始位置 -> 结束位置
+        QMap<qint64, QPair<QString, QString>>   contexts;       // 起始位置 -> (关键字, 上下文)
+        QMap<qint64, qint64>                    lines;          // 结束位置 -> 行号
+    };
+
+    // 文件标识, 缓存条目以扫描前取得的状态为键
+    struct FileStat
+    {
+        quint64         dev;
+        quint64         ino;
+        qint64          size;
+        qint64          mtime;                  // 纳秒
+    };
+
+    explicit ScanCache(const QString& dir);
+
+    static bool fileStat(const QString& filePath, FileStat& st);
+
+    bool isValid() const;
+    QString getDir() const;
+
+    bool lookup(const QString& filePath, const QByteArray& ruleSetHash, Entry& entry) const;
+    // before 为开始读文件前的状态; 扫描期间文件有变化(例如日志被追加)时不保存, 避免旧内容的结果挂在新的键上
+    bool store(const QString& filePath, const QByteArray& ruleSetHash, const Entry& entry, const FileStat& before);
+
+    // 删除某规则集的全部条目, 哈希由 RegexMatcher::ruleSetHash() 取得
+    bool removeRuleSet(const QByteArray& ruleSetHash);
+    // 只保留 ruleSetHash 对应的规则集, 规则更新后清理旧规则集留下的条目
+    bool removeOtherRuleSets(const QByteArray& ruleSetHash);
+
+private:
+    QString entryPath(quint64 dev, quint64 ino, const QByteArray& ruleSetHash) const;
+
+private:
+    QString                 mDir;
+    bool                    mValid = false;
+};
+
+
+#endif // hs_wrap_SCAN_CACHE_H
@@ -0,0 +1,464 @@
+//
+// Created by dingjing on 10/18/26.
+//
+
+#include "scan-service.h"
+
+#include <QFile>
+#include <QSet>
+#include <QDebug>
+#include <QDataStream>
+#include <fcntl.h>
+#include <cerrno>
+#include <cstring>
+#include <unistd.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+
+#include "macros/macros.h"
+
+
+static bool write_all(int sock, const char* data, std::size_t len, int fd);
+static bool read_all(int sock, char* data, std::size_t len, int* fd);
+static int create_memfd(const QByteArray& data);
+static QPair<QString, QString> match_context(const QByteArray& data, qint64 dataStart, qint64 start, qint64 end);
+
+
+bool scanServiceSend(int sock, const QByteArray& payload, int fd)
+{
+    C_RETURN_VAL_IF_FAIL(sock >= 0 && payload.size() <= SCAN_SERVICE_MAX_PAYLOAD, false);
+
+    const quint32 header[2] = { SCAN_SERVICE_MAGIC, static_cast<quint32>(payload.size()) };
+    C_RETURN_VAL_IF_FAIL(write_all(sock, reinterpret_cast<const char*>(header), sizeof(header), fd), false);
+
+    return write_all(sock, payload.constData(), payload.size(), -1);
+}
+
+bool scanServiceRecv(int sock, QByteArray& payload, int* fd, quint32 maxPayload)
+{
+    C_RETURN_VAL_IF_FAIL(sock >= 0, false);
+
+    if (fd) {
+        *fd = -1;
+    }
+
+    auto fail = [fd] () -> bool {
+        if (fd && *fd >= 0) {
+            ::close(*fd);
+            *fd = -1;
+        }
+        return false;
+    };
+
+    quint32 header[2] = { 0, 0 };
+    if (!read_all(sock, reinterpret_cast<char*>(header), sizeof(header), fd)) {
+        return fail();
+    }
+    if (SCAN_SERVICE_MAGIC != header[0] || header[1] > qMin<quint32>(maxPayload, SCAN_SERVICE_MAX_PAYLOAD)) {
+        qWarning() << "Invalid scan service frame, payload size: " << header[1];
+        return fail();
+    }
+
+    // 缓冲区随实际收到的数据增长, 只声明长度不发送数据的帧不会让接收方先分配整帧内存
+    const int total = static_cast<int>(header[1]);
+    payload.clear();
+    while (payload.size() < total) {
+        const int offset = payload.size();
+        const int step = qMin(total - offset, SCAN_SERVICE_INLINE_MAX);
+        payload.resize(offset + step);
+        if (!read_all(sock, payload.data() + offset, step, nullptr)) {
+            return fail();
+        }
+    }
+
+    return true;
+}
+
+ScanClient::ScanClient(const QString& reg, bool caseSensitive, const QString& socketPath)
+    : mSocketPath(socketPath), mCaseSensitive(caseSensitive)
+{
+    if (!reg.isEmpty()) {
+        mRegxStrings += reg;
+    }
+}
+
+ScanClient::ScanClient(const QStringList& regs, bool caseSensitive, const QString& socketPath)
+    : mSocketPath(socketPath), mCaseSensitive(caseSensitive)
+{
+    QSet<QString> seen;
+    seen.reserve(regs.count());
+    for (const auto& reg : regs) {
+        if (!reg.isEmpty() && !seen.contains(reg)) {
+            seen.insert(reg);
+            mRegxStrings += reg;
+        }
+    }
+}
+
+ScanClient::~ScanClient()
+{
+    disconnectService();
+}
+
+bool ScanClient::match(QFile& file)
+{
+    mFilePath = file.fileName();
+    mData.clear();
+
+    if (file.isOpen() && file.handle() >= 0) {
+        return scan(SCAN_SERVICE_SCAN_FD, QByteArray(), file.handle());
+    }
+
+    const int fd = ::open(file.fileName().toUtf8().constData(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        mMatchRes.clear();
+        mLastError = QString("open '%1' error: %2").arg(file.fileName(), strerror(errno));
+        return false;
+    }
+
+    const bool ret = scan(SCAN_SERVICE_SCAN_FD, QByteArray(), fd);
+    ::close(fd);
+
+    return ret;
+}
+
+bool ScanClient::match(const QString& str)
+{
+    return match(str.toUtf8());
+}
+
+bool ScanClient::match(const QByteArray& data)
+{
+    mFilePath.clear();
+    mData = data;
+
+    if (data.size() > SCAN_SERVICE_INLINE_MAX) {
+        const int fd = create_memfd(data);
+        if (fd >= 0) {
+            const bool ret = scan(SCAN_SERVICE_SCAN_FD, QByteArray(), fd);
+            ::close(fd);
+            return ret;
+        }
+    }
+
+    return scan(SCAN_SERVICE_SCAN_DATA, data, -1);
+}
+
+qint64 ScanClient::getMatchedCount() const
+{
+    return mMatchRes.size();
+}
+
+QMap<qint64, qint64> ScanClient::getMatchResults() const
+{
+    return mMatchRes;
+}
+
+ScanClient::ResultIterator ScanClient::getResultIterator() const
+{
+    return ResultIterator(*this);
+}
+
+QString ScanClient::getLastError() const
+{
+    return mLastError;
+}
+
+bool ScanClient::connectService()
+{
+    C_RETURN_VAL_IF_OK(mSocket >= 0, true);
+
+    struct sockaddr_un addr = {};
+    const QByteArray path = mSocketPath.toUtf8();
+    if (path.isEmpty() || path.size() >= static_cast<int>(sizeof(addr.sun_path))) {
+        mLastError = QString("invalid socket path '%1'").arg(mSocketPath);
+        return false;
+    }
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, path.constData(), path.size());
+
+    mSocket = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (mSocket < 0) {
+        mLastError = QString("socket error: %1").arg(strerror(errno));
+        return false;
+    }
+
+    if (0 != ::connect(mSocket, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr))) {
+        mLastError = QString("connect '%1' error: %2").arg(mSocketPath, strerror(errno));
+        disconnectService();
+        return false;
+    }
+
+    return true;
+}
+
+void ScanClient::disconnectService()
+{
+    C_RETURN_IF_FAIL(mSocket >= 0);
+
+    ::close(mSocket);
+    mSocket = -1;
+}
+
+bool ScanClient::loadRules()
+{
+    QByteArray payload;
+    QDataStream out(&payload, QIODevice::WriteOnly);
+    out.setVersion(QDataStream::Qt_5_0);
+    out << static_cast<quint8>(SCAN_SERVICE_LOAD_RULES) << mRegxStrings << mCaseSensitive;
+
+    QByteArray response;
+    C_RETURN_VAL_IF_FAIL(request(payload, -1, response), false);
+
+    qint32 status = SCAN_SERVICE_ERROR;
+    QString error;
+    QByteArray ruleSetId;
+    QDataStream in(response);
+    in.setVersion(QDataStream::Qt_5_0);
+    in >> status >> error >> ruleSetId;
+    if (QDataStream::Ok != in.status() || SCAN_SERVICE_OK != status || ruleSetId.isEmpty()) {
+        mLastError = error.isEmpty() ? QString("load rules error") : error;
+        return false;
+    }
+
+    mRuleSetId = ruleSetId;
+
+    return true;
+}
+
+bool ScanClient::request(const QByteArray& payload, int fd, QByteArray& response)
+{
+    C_RETURN_VAL_IF_FAIL(connectService(), false);
+
+    if (!scanServiceSend(mSocket, payload, fd) || !scanServiceRecv(mSocket, response)) {
+        // 服务端可能已重启, 断开后下次请求重新连接并加载规则
+        mLastError = QString("scan service '%1' disconnected").arg(mSocketPath);
+        mRuleSetId.clear();
+        disconnectService();
+        return false;
+    }
+
+    return true;
+}
+
+bool ScanClient::scan(int type, const QByteArray& data, int fd)
+{
+    mMatchRes.clear();
+
+    for (int i = 0; i < 2; ++i) {
+        if (mRuleSetId.isEmpty() && !loadRules()) {
+            continue;
+        }
+
+        QByteArray payload;
+        QDataStream out(&payload, QIODevice::WriteOnly);
+        out.setVersion(QDataStream::Qt_5_0);
+        out << static_cast<quint8>(type) << mRuleSetId;
+        if (SCAN_SERVICE_SCAN_DATA == type) {
+            out << data;
+        }
+
+        QByteArray response;
+        if (!request(payload, fd, response)) {
+            continue;
+        }
+
+        qint32 status = SCAN_SERVICE_ERROR;
+        QString error;
+        QDataStream in(response);
+        in.setVersion(QDataStream::Qt_5_0);
+        in >> status >> error;
+        if (SCAN_SERVICE_UNKNOWN_RULES == status) {
+            mRuleSetId.clear();
+            continue;
+        }
+
+        if (SCAN_SERVICE_OK == status) {
+            in >> mMatchRes;
+        }
+        if (QDataStream::Ok != in.status() || SCAN_SERVICE_OK != status) {
+            mMatchRes.clear();
+            mLastError = error.isEmpty() ? QString("scan error") : error;
+            return false;
+        }
+
+        return true;
+    }
+
+    return false;
+}
+
+ScanClient::ResultIterator::ResultIterator(const ScanClient& client)
+    : mClient(client)
+{
+    reset();
+}
+
+bool ScanClient::ResultIterator::hasNext() const
+{
+    return mCurrent != mEnd;
+}
+
+QPair<QString, QString> ScanClient::ResultIterator::next()
+{
+    QPair<QString, QString> pair("", "");
+
+    C_RETURN_VAL_IF_OK(mCurrent == mEnd, pair);
+
+    const qint64 s = mCurrent.key();
+    const qint64 e = mCurrent.value();
+    ++mCurrent;
+
+    const qint64 s1 = qMax(static_cast<qint64>(0), s - 24);
+    const qint64 e1 = e + 24;
+    if (mClient.mFilePath.isEmpty()) {
+        pair = match_context(mClient.mData, 0, s, e);
+    }
+    else {
+        QFile file(mClient.mFilePath);
+        if (file.open(QIODevice::ReadOnly) && file.seek(s1)) {
+            pair = match_context(file.read(e1 - s1), s1, s, e);
+        }
+    }
+
+    return pair;
+}
+
+void ScanClient::ResultIterator::reset()
+{
+    mCurrent = mClient.mMatchRes.constBegin();
+    mEnd = mClient.mMatchRes.constEnd();
+}
+
+static bool write_all(int sock, const char* data, std::size_t len, int fd)
+{
+    std::size_t pos = 0;
+    while (pos < len) {
+        struct iovec iov = { const_cast<char*>(data + pos), len - pos };
+        struct msghdr msg = {};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+
+        union {
+            char            buf[CMSG_SPACE(sizeof(int))];
+            struct cmsghdr  align;
+        } ctrl;
+        if (fd >= 0) {
+            // 描述符只随第一段数据发送
+            memset(&ctrl, 0, sizeof(ctrl));
+            msg.msg_control = ctrl.buf;
+            msg.msg_controllen = sizeof(ctrl.buf);
+            struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type = SCM_RIGHTS;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+            memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+        }
+
+        const ssize_t n = ::sendmsg(sock, &msg, MSG_NOSIGNAL);
+        if (n < 0 && EINTR == errno) {
+            continue;
+        }
+        C_RETURN_VAL_IF_FAIL(n > 0, false);
+
+        pos += static_cast<std::size_t>(n);
+        fd = -1;
+    }
+
+    return true;
+}
+
+static bool read_all(int sock, char* data, std::size_t len, int* fd)
+{
+    std::size_t pos = 0;
+    while (pos < len) {
+        struct iovec iov = { data + pos, len - pos };
+        struct msghdr msg = {};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+
+        union {
+            char            buf[CMSG_SPACE(sizeof(int) * 4)];
+            struct cmsghdr  align;
+        } ctrl;
+        msg.msg_control = ctrl.buf;
+        msg.msg_controllen = sizeof(ctrl.buf);
+
+        const ssize_t n = ::recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+        if (n < 0 && EINTR == errno) {
+            continue;
+        }
+        C_RETURN_VAL_IF_FAIL(n > 0, false);
+
+        for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (SOL_SOCKET != cmsg->cmsg_level || SCM_RIGHTS != cmsg->cmsg_type) {
+                continue;
+            }
+            const std::size_t num = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            for (std::size_t i = 0; i < num; ++i) {
+                int recvFd = -1;
+                memcpy(&recvFd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+                // 只接收一个描述符, 多余的或不需要的直接关闭
+                if (fd && *fd < 0) {
+                    *fd = recvFd;
+                }
+                else {
+                    ::close(recvFd);
+                }
+            }
+        }
+
+        pos += static_cast<std::size_t>(n);
+    }
+
+    return true;
+}
+
+static int create_memfd(const QByteArray& data)
+{
+#ifdef MFD_CLOEXEC
+    const int fd = memfd_create("hs-wrap-scan", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    C_RETURN_VAL_IF_FAIL(fd >= 0, -1);
+
+    qint64 pos = 0;
+    while (pos < data.size()) {
+        const ssize_t n = ::write(fd, data.constData() + pos, data.size() - pos);
+        if (n < 0 && EINTR == errno) {
+            continue;
+        }
+        if (n <= 0) {
+            ::close(fd);
+            return -1;
+        }
+        pos += n;
+    }
+
+    // 封住大小与内容, 服务端据此可以放心 mmap, 不会因为文件被截断而 SIGBUS
+    fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL);
+
+    return fd;
+#else
+    (void) data;
+    return -1;
+#endif
+}
+
+static QPair<QString, QString> match_context(const QByteArray& data, qint64 dataStart, qint64 start, qint64 end)
+{
+    const qint64 len = data.size();
+    qint64 s = qBound(static_cast<qint64>(0), start - dataStart, len);
+    qint64 e = qBound(s, end - dataStart, len);
+    qint64 s1 = qMax(static_cast<qint64>(0), s - 24);
+    qint64 e1 = qMin(len, e + 24);
+
+    // 上下文两端对齐到 utf-8 字符边界
+    const char* p = data.constData();
+    while (s1 < s && 0x80 == (static_cast<uchar>(p[s1]) & 0xC0)) { ++s1; }
+    while (e1 > e && e1 < len && 0x80 == (static_cast<uchar>(p[e1]) & 0xC0)) { --e1; }
+
+    const QString key = QString::fromUtf8(p + s, static_cast<int>(e - s));
+    const QString ctx = QString::fromUtf8(p + s1, static_cast<int>(e1 - s1));
+
+    return QPair<QString, QString>(key, ctx);
+}
@@ -0,0 +1,113 @@
+//
+// Created by dingjing on 10/18/26.
+//
+
+#ifndef hs_wrap_SCAN_SERVICE_H
+#define hs_wrap_SCAN_SERVICE_H
+#include <qmap.h>
+#include <qpair.h>
+#include <QString>
+#include <QByteArray>
+#include <QStringList>
+
+
+class QFile;
+
+
+/**
+ * 本地扫描服务(hs-wrap-daemon)的协议与客户端
+ *  守护进程常驻编译好的规则库, 多个进程共用; 客户端通过 UNIX 域套接字提交扫描请求.
+ *  文件以文件描述符(SCM_RIGHTS)传给服务端, 数据不经过套接字拷贝; 服务端用 pread 读普通文件
+ *  (扫描中文件被截断时 mmap 会导致 SIGBUS). 较大的内存数据先写入封口(sealed)的 memfd 再传描述符,
+ *  封口后大小不会再变, 服务端直接 mmap. 服务端只扫描收到的描述符, 不按路径打开文件,
+ *  因此客户端没有读权限的文件也无法借服务端扫描.
+ *
+ * 帧格式: [magic u32][payload 长度 u32][payload], 描述符附在帧头上;
+ *  payload 为 QDataStream 序列化的数据, 第一个字段为请求类型.
+ */
+#define SCAN_SERVICE_SOCKET         "/run/hs-wrap-daemon.sock"
+#define SCAN_SERVICE_MAGIC          0x48535356
+#define SCAN_SERVICE_MAX_PAYLOAD    (64 << 20)
+#define SCAN_SERVICE_INLINE_MAX     (64 << 10)      // 不超过此大小的内存数据直接随请求发送
+
+enum ScanServiceRequest
+{
+    SCAN_SERVICE_LOAD_RULES = 1,                    // QStringList 规则, bool 大小写敏感 -> 规则集 id
+    SCAN_SERVICE_SCAN_FD,                           // 规则集 id, 描述符 -> 匹配结果
+    SCAN_SERVICE_SCAN_DATA,                         // 规则集 id, QByteArray 数据(不超过 SCAN_SERVICE_INLINE_MAX) -> 匹配结果
+};
+
+enum ScanServiceStatus
+{
+    SCAN_SERVICE_OK = 0,
+    SCAN_SERVICE_ERROR,
+    SCAN_SERVICE_UNKNOWN_RULES,                     // 服务端没有该规则集(例如守护进程重启过), 需重新加载
+};
+
+// 发送/接收一帧, fd < 0 表示不带描述符; 接收到的描述符由调用者关闭; payload 超过 maxPayload 的帧直接失败
+bool scanServiceSend(int sock, const QByteArray& payload, int fd=-1);
+bool scanServiceRecv(int sock, QByteArray& payload, int* fd=nullptr, quint32 maxPayload=SCAN_SERVICE_MAX_PAYLOAD);
+
+
+/**
+ * 扫描服务客户端, 用法与 RegexMatcher 相同, 匹配结果为 起始位置 -> 结束位置 的字节偏移.
+ *  第一次匹配时连接服务并加载规则, 服务端已有相同规则集时直接复用; 连接断开时自动重连一次.
+ *  对象本身不是线程安全的, 每个线程使用各自的客户端.
+ *
+ * 与 RegexMatcher 的差异: 服务端固定使用 SOM 模式, 不支持 setNoSomMode/setTextFilter/setLineReport/setScanCache,
+ *  hyperscan 无法编译的规则集直接失败, 不回退到 QRegExp; ResultIterator 不提供行号.
+ */
+class ScanClient final
+{
+public:
+    class ResultIterator
+    {
+    public:
+        explicit ResultIterator(const ScanClient& client);
+        bool hasNext() const;
+        // keyword, context: 上下文为匹配前后各 24 字节, 在客户端按匹配时的文件路径或数据读取
+        QPair<QString, QString> next();
+        void reset();
+
+    private:
+        const ScanClient&                       mClient;
+        QMap<qint64, qint64>::const_iterator    mEnd;
+        QMap<qint64, qint64>::const_iterator    mCurrent;
+    };
+
+    explicit ScanClient(const QString& reg, bool caseSensitive=true, const QString& socketPath=SCAN_SERVICE_SOCKET);
+    explicit ScanClient(const QStringList& regs, bool caseSensitive=true, const QString& socketPath=SCAN_SERVICE_SOCKET);
+    ~ScanClient();
+    ScanClient(const ScanClient&) = delete;
+    ScanClient& operator= (const ScanClient&) = delete;
+
+    bool match(QFile& file);
+    bool match(const QString& str);
+    bool match(const QByteArray& data);
+
+    qint64 getMatchedCount() const;
+    QMap<qint64, qint64> getMatchResults() const;
+    ResultIterator getResultIterator() const;
+    QString getLastError() const;
+
+private:
+    bool connectService();
+    void disconnectService();
+    bool loadRules();
+    bool request(const QByteArray& payload, int fd, QByteArray& response);
+    bool scan(int type, const QByteArray& data, int fd);
+
+private:
+    QString                     mSocketPath;
+    QStringList                 mRegxStrings;
+    bool                        mCaseSensitive = true;
+    int                         mSocket = -1;
+    QByteArray                  mRuleSetId;
+    QMap<qint64, qint64>        mMatchRes;
+    QString                     mFilePath;          // 最近一次匹配的文件, 匹配内存数据时为空
+    QByteArray                  mData;              // 最近一次匹配的内存数据
+    QString                     mLastError;
+};
+
+
+#endif // hs_wrap_SCAN_SERVICE_H
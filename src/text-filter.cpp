@@ -0,0 +1,200 @@
+//
+// Created by dingjing on 10/18/26.
+//
+
+#include "text-filter.h"
+
+#include <algorithm>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+
+static inline bool is_control_byte(unsigned char c)
+{
+    return (c < 0x20 && c != '\t' && c != '\n' && c != '\v' && c != '\f' && c != '\r' && c != 0x1B) || 0x7F == c;
+}
+
+static inline bool is_printable_ascii(unsigned char c)
+{
+    return (c >= 0x20 && c < 0x7F) || '\t' == c || '\n' == c || '\r' == c;
+}
+
+// 返回 data[pos] 处合法 utf-8 多字节字符的长度, 不合法时返回 0
+static inline std::size_t utf8_char_len(const unsigned char* data, std::size_t pos, std::size_t len)
+{
+    const unsigned char c = data[pos];
+    std::size_t n = 0;
+    if (c >= 0xC2 && c <= 0xDF) { n = 2; }
+    else if (c >= 0xE0 && c <= 0xEF) { n = 3; }
+    else if (c >= 0xF0 && c <= 0xF4) { n = 4; }
+    else { return 0; }
+
+    if (pos + n > len) { return 0; }
+    for (std::size_t i = 1; i < n; ++i) {
+        if (0x80 != (data[pos + i] & 0xC0)) { return 0; }
+    }
+
+    return n;
+}
+
+static void append_range(std::vector<TextRange>& ranges, std::size_t start, std::size_t end)
+{
+    if (start >= end) { return; }
+
+    // 多字节字符可能跨过小块边界, 与上一区间相接或重叠时合并
+    if (!ranges.empty() && ranges.back().end >= start) {
+        if (end > ranges.back().end) {
+            ranges.back().end = end;
+        }
+        return;
+    }
+
+    TextRange r = { start, end };
+    ranges.push_back(r);
+}
+
+void textFilterCountControl(const char* data, std::size_t len, std::size_t* ctrl, std::size_t* nul)
+{
+    std::size_t c = 0;
+    std::size_t z = 0;
+    std::size_t i = 0;
+
+#if defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i minusOne = _mm_set1_epi8(-1);
+    const __m128i space = _mm_set1_epi8(0x20);
+    const __m128i del = _mm_set1_epi8(0x7F);
+    const __m128i tab = _mm_set1_epi8('\t');
+    const __m128i cr = _mm_set1_epi8('\r');
+    const __m128i esc = _mm_set1_epi8(0x1B);
+    for (; i + 16 <= len; i += 16) {
+        const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+        // 有符号比较: >= 0x80 的字节为负数, 不计入控制字符
+        const __m128i lt20 = _mm_and_si128(_mm_cmpgt_epi8(v, minusOne), _mm_cmplt_epi8(v, space));
+        // \t \n \v \f \r 连续, 即 [0x09, 0x0D]
+        const __m128i ws = _mm_or_si128(_mm_and_si128(_mm_cmpgt_epi8(v, _mm_sub_epi8(tab, _mm_set1_epi8(1))), _mm_cmplt_epi8(v, _mm_add_epi8(cr, _mm_set1_epi8(1)))), _mm_cmpeq_epi8(v, esc));
+        const __m128i ctl = _mm_or_si128(_mm_andnot_si128(ws, lt20), _mm_cmpeq_epi8(v, del));
+        c += __builtin_popcount(_mm_movemask_epi8(ctl));
+        z += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero)));
+    }
+#endif
+
+    for (; i < len; ++i) {
+        const unsigned char b = static_cast<unsigned char>(data[i]);
+        if (is_control_byte(b)) { ++c; }
+        if (0 == b) { ++z; }
+    }
+
+    if (ctrl) { *ctrl = c; }
+    if (nul) { *nul = z; }
+}
+
+std::size_t textFilterCountNewlines(const char* data, std::size_t len)
+{
+    std::size_t n = 0;
+    std::size_t i = 0;
+
+#if defined(__SSE2__)
+    const __m128i lf = _mm_set1_epi8('\n');
+    for (; i + 64 <= len; i += 64) {
+        const __m128i v0 = _mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i)), lf);
+        const __m128i v1 = _mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i + 16)), lf);
+        const __m128i v2 = _mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i + 32)), lf);
+        const __m128i v3 = _mm_cmpeq_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i + 48)), lf);
+        const unsigned long long mask = static_cast<unsigned long long>(_mm_movemask_epi8(v0))
+                                      | (static_cast<unsigned long long>(_mm_movemask_epi8(v1)) << 16)
+                                      | (static_cast<unsigned long long>(_mm_movemask_epi8(v2)) << 32)
+                                      | (static_cast<unsigned long long>(_mm_movemask_epi8(v3)) << 48);
+        n += __builtin_popcountll(mask);
+    }
+#endif
+
+    for (; i < len; ++i) {
+        if ('\n' == data[i]) { ++n; }
+    }
+
+    return n;
+}
+
+bool textFilterIsBinary(const char* data, std::size_t len)
+{
+    std::size_t ctrl = 0;
+    std::size_t nul = 0;
+    textFilterCountControl(data, len, &ctrl, &nul);
+
+    // 文本中几乎不会出现 NUL, 控制字符超过 1/16 也视为二进制
+    return nul > 0 || ctrl * 16 > len;
+}
+
+static void extract_text_runs(const char* data, std::size_t blockStart, std::size_t blockEnd, std::size_t len, std::vector<TextRange>& ranges)
+{
+    const unsigned char* d = reinterpret_cast<const unsigned char*>(data);
+
+    std::size_t i = blockStart;
+    while (i < blockEnd) {
+        const std::size_t runStart = i;
+        while (i < blockEnd) {
+#if defined(__SSE2__)
+            // 16 字节全是可打印 ascii 时整段跳过
+            if (i + 16 <= blockEnd) {
+                const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+                const __m128i pr = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8(0x1F)), _mm_cmplt_epi8(v, _mm_set1_epi8(0x7F)));
+                if (0xFFFF == _mm_movemask_epi8(pr)) {
+                    i += 16;
+                    continue;
+                }
+            }
+#endif
+            if (is_printable_ascii(d[i])) {
+                ++i;
+                continue;
+            }
+            const std::size_t n = utf8_char_len(d, i, len);
+            if (0 == n) {
+                break;
+            }
+            i += n;
+        }
+
+        // 与文本块或缓冲区首尾相接的片段可能更长, 保留
+        const bool edge = (blockStart == runStart) || (i >= blockEnd);
+        if (i > runStart && (edge || i - runStart >= TEXT_FILTER_MIN_RUN)) {
+            append_range(ranges, runStart, i);
+        }
+
+        if (i == runStart) {
+            ++i;
+        }
+    }
+}
+
+void textFilterRanges(const char* data, std::size_t len, TextFilterMode mode, std::vector<TextRange>& ranges)
+{
+    ranges.clear();
+
+    if (TEXT_FILTER_NONE == mode) {
+        append_range(ranges, 0, len);
+        return;
+    }
+
+    // 连续的二进制块合成一段再提取, 可打印片段可以跨过小块边界, 最短长度按合并后的片段计算
+    std::size_t binaryStart = len;
+    for (std::size_t start = 0; start < len; start += TEXT_FILTER_BLOCK_SIZE) {
+        const std::size_t end = (len - start > TEXT_FILTER_BLOCK_SIZE) ? start + TEXT_FILTER_BLOCK_SIZE : len;
+        if (textFilterIsBinary(data + start, end - start)) {
+            binaryStart = std::min(binaryStart, start);
+            continue;
+        }
+        if (binaryStart < start && TEXT_FILTER_EXTRACT_TEXT == mode) {
+            extract_text_runs(data, binaryStart, start, len, ranges);
+        }
+        binaryStart = len;
+        append_range(ranges, start, end);
+    }
+
+    if (binaryStart < len && TEXT_FILTER_EXTRACT_TEXT == mode) {
+        extract_text_runs(data, binaryStart, len, len, ranges);
+    }
+}
@@ -0,0 +1,42 @@
+//
+// Created by dingjing on 10/18/26.
+//
+// 二进制内容过滤: 按 4K 小块判断文本/二进制, 二进制块跳过或只提取其中可打印的 utf-8 片段(类似 strings(1)),
+// 扫描时只送入返回的区间, 偏移保持为原始数据中的偏移.
+//
+
+#ifndef hs_wrap_TEXT_FILTER_H
+#define hs_wrap_TEXT_FILTER_H
+#include <vector>
+#include <cstddef>
+
+#define TEXT_FILTER_BLOCK_SIZE      4096
+#define TEXT_FILTER_MIN_RUN         4
+
+enum TextFilterMode
+{
+    TEXT_FILTER_NONE = 0,               // 全部扫描
+    TEXT_FILTER_SKIP_BINARY,            // 跳过二进制块
+    TEXT_FILTER_EXTRACT_TEXT,           // 二进制块中只扫描可打印片段
+};
+
+struct TextRange
+{
+    std::size_t     start;
+    std::size_t     end;
+};
+
+// 统计控制字符(不含 \t \n \v \f \r ESC)与 NUL 的数量, 有 SSE2 时按 16 字节并行
+void textFilterCountControl(const char* data, std::size_t len, std::size_t* ctrl, std::size_t* nul);
+
+bool textFilterIsBinary(const char* data, std::size_t len);
+
+// 统计 '\n' 数量, 有 SSE2 时按 16 字节并行
+std::size_t textFilterCountNewlines(const char* data, std::size_t len);
+
+// 计算 data 中需要扫描的区间, 结果按起始位置升序且相邻区间已合并.
+// 与 data 首尾相接的片段可能延续到相邻缓冲区, 不受最小长度限制
+void textFilterRanges(const char* data, std::size_t len, TextFilterMode mode, std::vector<TextRange>& ranges);
+
+
+#endif // hs_wrap_TEXT_FILTER_H